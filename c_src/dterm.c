@@ -24,6 +24,8 @@
 static ErlDrvTermData am_true;
 static ErlDrvTermData am_false;
 
+static void atom_cache_init(void);
+static void atom_cache_finish(void);
 
 /******************************************************************************
  *
@@ -34,15 +36,149 @@ static ErlDrvTermData am_false;
 void dterm_lib_init()
 {
     dlib_init();
+    atom_cache_init();
     am_true = driver_mk_atom("true");
     am_false = driver_mk_atom("false");
 }
 
 void dterm_lib_finish()
 {
+    atom_cache_finish();
     dlib_finish();
 }
 
+/******************************************************************************
+ *
+ *  Atom cache
+ *
+ *****************************************************************************/
+
+// Read mostly hash table of atoms by name. Lookups do not lock, entries
+// are published with a release store to the bucket head and are only
+// removed by dterm_lib_finish. Inserts are serialized by atom_mtx.
+
+#define ATOM_HASH_SIZE 512
+
+#if defined(__ATOMIC_ACQUIRE)
+#define ATOM_LOAD(p)     __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define ATOM_STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#else
+#define ATOM_LOCKED_LOOKUP 1
+#define ATOM_LOAD(p)     (p)
+#define ATOM_STORE(p, v) ((p) = (v))
+#endif
+
+typedef struct _atom_entry_t {
+    struct _atom_entry_t* next;
+    unsigned int   hash;
+    ErlDrvTermData atom;
+    char           name[];
+} atom_entry_t;
+
+static atom_entry_t* atom_hash[ATOM_HASH_SIZE];
+static ErlDrvMutex*  atom_mtx;
+static dterm_atom_t* atom_static;  // DTERM_ATOM declarations
+
+static unsigned int atom_hash_name(const char* name)
+{
+    uint32_t h = 2166136261U;
+
+    while(*name) {
+	h ^= (uint8_t) *name++;
+	h *= 16777619U;
+    }
+    return h;
+}
+
+static atom_entry_t* atom_lookup(const char* name, unsigned int h)
+{
+    atom_entry_t* e = ATOM_LOAD(atom_hash[h % ATOM_HASH_SIZE]);
+
+    while(e && ((e->hash != h) || (strcmp(e->name, name) != 0)))
+	e = e->next;
+    return e;
+}
+
+static void atom_cache_init(void)
+{
+    dterm_atom_t* a;
+
+    memset(atom_hash, 0, sizeof(atom_hash));
+    atom_mtx = erl_drv_mutex_create("dterm_atom_mtx");
+    for (a = atom_static; a != NULL; a = a->next)
+	a->atom = dterm_mk_atom(a->name);
+}
+
+static void atom_cache_finish(void)
+{
+    dterm_atom_t* a;
+    int i;
+
+    for (a = atom_static; a != NULL; a = a->next)
+	a->atom = 0;
+    for (i = 0; i < ATOM_HASH_SIZE; i++) {
+	atom_entry_t* e = atom_hash[i];
+	while(e) {
+	    atom_entry_t* next = e->next;
+	    DFREE(e);
+	    e = next;
+	}
+	atom_hash[i] = NULL;
+    }
+    if (atom_mtx) {
+	erl_drv_mutex_destroy(atom_mtx);
+	atom_mtx = NULL;
+    }
+}
+
+// Atom for name, driver_mk_atom is called once per distinct name
+ErlDrvTermData dterm_mk_atom(const char* name)
+{
+    unsigned int h = atom_hash_name(name);
+    atom_entry_t* e;
+    ErlDrvTermData atom;
+    size_t len;
+
+#ifndef ATOM_LOCKED_LOOKUP
+    if ((e = atom_lookup(name, h)) != NULL)
+	return e->atom;
+#endif
+    if (!atom_mtx)  // dterm_lib_init not called
+	return driver_mk_atom((char*) name);
+    erl_drv_mutex_lock(atom_mtx);
+    if ((e = atom_lookup(name, h)) != NULL) {
+	atom = e->atom;
+	erl_drv_mutex_unlock(atom_mtx);
+	return atom;
+    }
+    atom = driver_mk_atom((char*) name);
+    len = strlen(name);
+    if ((e = DALLOC(sizeof(atom_entry_t)+len+1)) != NULL) {
+	e->hash = h;
+	e->atom = atom;
+	memcpy(e->name, name, len+1);
+	e->next = atom_hash[h % ATOM_HASH_SIZE];
+	ATOM_STORE(atom_hash[h % ATOM_HASH_SIZE], e);
+    }
+    erl_drv_mutex_unlock(atom_mtx);
+    return atom;
+}
+
+// Register a DTERM_ATOM declaration (done by a constructor with gcc)
+void dterm_atom_register(dterm_atom_t* a)
+{
+    a->next = atom_static;
+    atom_static = a;
+    if (atom_mtx)
+	a->atom = dterm_mk_atom(a->name);
+}
+
+// Make a declared atom on first use
+ErlDrvTermData dterm_atom_resolve(dterm_atom_t* a)
+{
+    return (a->atom = dterm_mk_atom(a->name));
+}
+
 void dterm_init(dterm_t* p)
 {
     p->dyn_alloc = 0;
@@ -51,6 +187,9 @@ void dterm_init(dterm_t* p)
     p->ptr       = p->data;
     p->ptr_end   = p->data + DTERM_FIXED;
     p->head      = 0;
+    p->cur       = 0;
+    p->aptr      = 0;
+    p->aend      = 0;
     p->mark      = 0;
 }
 
@@ -107,25 +246,26 @@ int dterm_dump(FILE* f, ErlDrvTermData* spec, int len)
 	    i += 2;
 	    break;
 	case ERL_DRV_STRING:
-	    fprintf(f, "%d: STRING %d \"%s\"\r\n", i,
-		    (int)spec[i+2], (char*)spec[i+1]);
+	    fprintf(f, "%d: STRING %d \"%.*s\"\r\n", i,
+		    (int)spec[i+2], (int)spec[i+2], (char*)spec[i+1]);
 	    i += 3;
 	    break;
 	case ERL_DRV_STRING_CONS:
-	    fprintf(f, "%d: STRING_CONS %d \"%s\"\r\n", i,
-		    (int)spec[i+2], (char*)spec[i+1]);
+	    fprintf(f, "%d: STRING_CONS %d \"%.*s\"\r\n", i,
+		    (int)spec[i+2], (int)spec[i+2], (char*)spec[i+1]);
 	    i += 3;
 	    break;
 	case ERL_DRV_BUF2BINARY:
-	    fprintf(f, "%d: BUF2BINARY_CONS %d <<%s>>\r\n", i,
-		    (int)spec[i+2], (char*)spec[i+1]);
+	    fprintf(f, "%d: BUF2BINARY_CONS %d <<%.*s>>\r\n", i,
+		    (int)spec[i+2], (int)spec[i+2], (char*)spec[i+1]);
 	    i += 3;
 	    break;
 	case ERL_DRV_BINARY:
-	    fprintf(f, "%d: BINARY\r\n", i);
-	    // not yet!!!
+	    fprintf(f, "%d: BINARY %d+%d <<%.*s>>\r\n", i,
+		    (int)spec[i+3], (int)spec[i+2], (int)spec[i+2],
+		    ((ErlDrvBinary*)spec[i+1])->orig_bytes + spec[i+3]);
 	    i += 4;
-	    return -1;
+	    break;
 	default:
 	    return -1;
 	}
@@ -135,7 +275,8 @@ int dterm_dump(FILE* f, ErlDrvTermData* spec, int len)
 
 
 // Calculate the size of pointer portion
-// When sending a message in the non SMP buffer and data are copied
+// When sending a message in the non SMP buffer and data are copied,
+// binaries are not copied (see dterm_dyn_copy)
 int dterm_dyn_size(ErlDrvTermData* spec, int len)
 {
     size_t n = 0;
@@ -180,10 +321,7 @@ int dterm_dyn_size(ErlDrvTermData* spec, int len)
 	    i += 3;
 	    break;
 	case ERL_DRV_BINARY:
-	    // not yet!!!
-	    n += spec[i+2];
 	    i += 4;
-	    return -1;
 	    break;
 	default:
 	    return -1;
@@ -192,7 +330,9 @@ int dterm_dyn_size(ErlDrvTermData* spec, int len)
     return (int) n;
 }
 
-// When sending a message in the non SMP buffer and data are copied
+// When sending a message in the non SMP buffer and data are copied,
+// binaries are referenced (driver_binary_inc_refc), release them with
+// dterm_dyn_release when the copy is no longer needed
 char* dterm_dyn_copy(ErlDrvTermData* spec, int len, char* ptr)
 {
     int i = 0;
@@ -247,10 +387,8 @@ char* dterm_dyn_copy(ErlDrvTermData* spec, int len, char* ptr)
 	    i += 3;
 	    break;
 	case ERL_DRV_BINARY:
-	    // wont work yet! (maybe change to BUF2BINARY)
-	    ptr += spec[i+2];
+	    driver_binary_inc_refc((ErlDrvBinary*) spec[i+1]);
 	    i += 4;
-	    return NULL;
 	    break;
 	default:
 	    return NULL;
@@ -259,6 +397,31 @@ char* dterm_dyn_copy(ErlDrvTermData* spec, int len, char* ptr)
     return ptr;
 }
 
+// Release the binary references in a spec (see dterm_dyn_copy)
+void dterm_dyn_release(ErlDrvTermData* spec, int len)
+{
+    int i = 0;
+    while(i < len) {
+	switch(spec[i]) {
+	case ERL_DRV_NIL:
+	    i++;
+	    break;
+	case ERL_DRV_STRING:
+	case ERL_DRV_STRING_CONS:
+	case ERL_DRV_BUF2BINARY:
+	    i += 3;
+	    break;
+	case ERL_DRV_BINARY:
+	    driver_free_binary((ErlDrvBinary*) spec[i+1]);
+	    i += 4;
+	    break;
+	default:
+	    i += 2;
+	    break;
+	}
+    }
+}
+
 
 
 // dynamic allocation of dterm_t structure, the data part is
@@ -276,6 +439,9 @@ dterm_t* dterm_alloc(size_t size)
 	p->ptr        = p->data;
 	p->ptr_end    = p->data + p->dyn_size;
 	p->head       = 0;
+	p->cur        = 0;
+	p->aptr       = 0;
+	p->aend       = 0;
 	p->mark       = 0;
     }
     return p;
@@ -292,6 +458,8 @@ void dterm_reset_links(dterm_t* p)
 	}
 	p->head = NULL;
     }
+    p->cur = NULL;
+    p->aptr = p->aend = NULL;
 }
 
 void dterm_finish(dterm_t* p)
@@ -308,18 +476,21 @@ void dterm_free(dterm_t* p)
 	DFREE(p);
 }
     
-// reset base pointer & clear link space
+// reset base pointer & clear link space, the spec buffer and the
+// arena chunks are kept for reuse
 void dterm_reset(dterm_t* p)
 {
     p->ptr = p->base;  // restart allocation
-    dterm_reset_links(p);
+    p->cur = NULL;
+    p->aptr = p->aend = NULL;
 }
 
+// grow the spec buffer by at least n, at least doubling it
 int dterm_expand(dterm_t* p, size_t n)
 {
     ErlDrvTermData* new_base;
     size_t old_size = dterm_allocated_size(p);
-    size_t new_size = old_size + n;
+    size_t new_size = (n > old_size) ? old_size + n : 2*old_size;
     size_t old_sz   = old_size * sizeof(ErlDrvTermData);
     size_t new_sz   = new_size * sizeof(ErlDrvTermData);
     ptrdiff_t offset = p->ptr - p->base;  // offset of ptr
@@ -338,20 +509,46 @@ int dterm_expand(dterm_t* p, size_t n)
     return 1;
 }
 
-// auxillary space
+// auxillary space, bump allocated from the arena chunks. Move on to
+// the next chunk (kept from before a reset) or insert a new one after
+// the current when the request does not fit.
 void* dterm_link_alloc_data(dterm_t* p, size_t size)
 {
-    dterm_link_t* lp = DALLOC(sizeof(dterm_link_t)+size);
-    lp->next = p->head;
-    p->head = lp;
-    return (void*) &lp->data[0];
+    void* ptr;
+
+    size = (size + sizeof(ErlDrvTermData)-1) & ~(sizeof(ErlDrvTermData)-1);
+    if ((size_t)(p->aend - p->aptr) < size) {
+	dterm_link_t* lp = p->cur ? p->cur->next : p->head;
+
+	if (!lp || (lp->size < size)) {
+	    size_t sz = (size > DTERM_CHUNK) ? size : DTERM_CHUNK;
+	    if ((lp = DALLOC(sizeof(dterm_link_t)+sz)) == NULL)
+		return NULL;
+	    lp->size = sz;
+	    if (p->cur) {
+		lp->next = p->cur->next;
+		p->cur->next = lp;
+	    }
+	    else {
+		lp->next = p->head;
+		p->head = lp;
+	    }
+	}
+	p->cur  = lp;
+	p->aptr = lp->data;
+	p->aend = lp->data + lp->size;
+    }
+    ptr = p->aptr;
+    p->aptr += size;
+    return ptr;
 }
 
 // auxillary space
 void* dterm_link_copy_data(dterm_t* p, void* src, size_t size)
 {
     void* dst = dterm_link_alloc_data(p, size);
-    memcpy(dst, src, size);
+    if (dst)
+	memcpy(dst, src, size);
     return dst;
 }
 
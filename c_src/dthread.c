@@ -24,33 +24,106 @@
 
 #include "../include/dthread.h"
 #include "../include/dlog.h"
+#include "../include/ddata.h"
 
 
 #ifdef __WIN32__
 #include <windows.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#ifdef DTHREAD_HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#ifdef DTHREAD_HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef DTHREAD_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#endif
+#include <time.h>
+#include <errno.h>
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <ctype.h>
 
+#ifdef __WIN32__
+#define DTHREAD_YIELD() SwitchToThread()
+#else
+#include <sched.h>
+#define DTHREAD_YIELD() sched_yield()
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+#define DTHREAD_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define DTHREAD_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define DTHREAD_CPU_RELAX() do {} while(0)
+#endif
+
+// yield the cpu every n spins
+#define DTHREAD_SPIN_YIELD  64
+
 static ErlDrvTermData am_data;
 static ErlDrvTermData am_ok;
 static ErlDrvTermData am_error;
 
+// Reply templates, the holes are patched for each send
+#define OK_REF        1   // {Ref, ok}
+#define OK_LEN        6
+#define ERROR_REF     1   // {Ref, {error, Reason}}
+#define ERROR_REASON  5
+#define ERROR_LEN     10
+
+static ErlDrvTermData ok_template[OK_LEN];
+static ErlDrvTermData error_template[ERROR_LEN];
+
+// errno atoms, made by dthread_lib_init and only read after that
+#define ERRNO_ATOM_MAX 256
+static ErlDrvTermData errno_atom[ERRNO_ATOM_MAX];
+
+static ErlDrvTermData errno_mk_atom(int err);
+static void dmessage_lib_init(void);
+static void dmessage_lib_finish(void);
+
 void dthread_lib_init()
 {
+    ErlDrvTermData* spec;
+    int i;
+
     dterm_lib_init();
+    dmessage_lib_init();
     am_data = driver_mk_atom("data");
     am_ok = driver_mk_atom("ok");
     am_error = driver_mk_atom("error");
+
+    spec = ok_template;
+    *spec++ = ERL_DRV_INT;  *spec++ = 0;  // OK_REF
+    *spec++ = ERL_DRV_ATOM; *spec++ = am_ok;
+    *spec++ = ERL_DRV_TUPLE; *spec++ = 2;
+
+    spec = error_template;
+    *spec++ = ERL_DRV_INT;  *spec++ = 0;  // ERROR_REF
+    *spec++ = ERL_DRV_ATOM; *spec++ = am_error;
+    *spec++ = ERL_DRV_ATOM; *spec++ = 0;  // ERROR_REASON
+    *spec++ = ERL_DRV_TUPLE; *spec++ = 2;
+    *spec++ = ERL_DRV_TUPLE; *spec++ = 2;
+
+    for (i = 0; i < ERRNO_ATOM_MAX; i++)
+	errno_atom[i] = errno_mk_atom(i);
 }
 
 void dthread_lib_finish()
 {
+    dmessage_lib_finish();
     dterm_lib_finish();
 }
 
@@ -60,11 +133,187 @@ void dthread_lib_finish()
  *
  *****************************************************************************/
 
+// Message allocation
+//
+// Messages up to DMESSAGE_MAX_CLASS_SIZE bytes of data are kept in
+// size class free lists.  Each thread has its own cache (found through
+// thread specific data) so the common alloc/free path takes no lock.
+// Messages are normally allocated by the sender and freed by the
+// receiver, so caches drift; when a thread cache grows above
+// DMESSAGE_CACHE_MAX a batch is handed back to a shared depot, and an
+// empty cache is refilled with a batch from the depot.
+//
+#define DMESSAGE_NUM_CLASSES    4
+#define DMESSAGE_MAX_CLASS_SIZE 4096
+#define DMESSAGE_CACHE_MAX      64    // max cached per class and thread
+#define DMESSAGE_CACHE_BATCH    32    // moved to/from depot at a time
+#define DMESSAGE_DEPOT_MAX      1024  // max cached per class in depot
+
+static const size_t dmessage_class_size[DMESSAGE_NUM_CLASSES] =
+{ 64, 256, 1024, DMESSAGE_MAX_CLASS_SIZE };
+
+typedef struct _dmessage_cache_t {
+    struct _dmessage_cache_t* next;  // all thread caches (for cleanup)
+    dmessage_t* free[DMESSAGE_NUM_CLASSES];
+    int         nfree[DMESSAGE_NUM_CLASSES];
+} dmessage_cache_t;
+
+static ErlDrvTSDKey      dmessage_key;
+static ErlDrvMutex*      dmessage_mtx;  // protect depot and cache list
+static dmessage_cache_t* dmessage_caches;
+static dmessage_t*       dmessage_depot[DMESSAGE_NUM_CLASSES];
+static int               dmessage_ndepot[DMESSAGE_NUM_CLASSES];
+
+static void dmessage_lib_init(void)
+{
+    if (erl_drv_tsd_key_create("dmessage_cache", &dmessage_key) != 0)
+	return;
+    if (!(dmessage_mtx = erl_drv_mutex_create("dmessage_depot")))
+	erl_drv_tsd_key_destroy(dmessage_key);
+}
+
+static void dmessage_free_list(dmessage_t* mp)
+{
+    while(mp) {
+	dmessage_t* mn = mp->next;
+	DFREE(mp);
+	mp = mn;
+    }
+}
+
+static void dmessage_lib_finish(void)
+{
+    dmessage_cache_t* cache;
+    int c;
+
+    if (!dmessage_mtx)
+	return;
+    while((cache = dmessage_caches)) {
+	dmessage_caches = cache->next;
+	for (c = 0; c < DMESSAGE_NUM_CLASSES; c++)
+	    dmessage_free_list(cache->free[c]);
+	DFREE(cache);
+    }
+    for (c = 0; c < DMESSAGE_NUM_CLASSES; c++) {
+	dmessage_free_list(dmessage_depot[c]);
+	dmessage_depot[c] = NULL;
+	dmessage_ndepot[c] = 0;
+    }
+    erl_drv_mutex_destroy(dmessage_mtx);
+    dmessage_mtx = NULL;
+    erl_drv_tsd_key_destroy(dmessage_key);
+}
+
+static int dmessage_class(size_t n)
+{
+    int c;
+    if (!dmessage_mtx || (n > DMESSAGE_MAX_CLASS_SIZE))
+	return -1;
+    for (c = 0; n > dmessage_class_size[c]; c++)
+	;
+    return c;
+}
+
+static dmessage_cache_t* dmessage_cache(void)
+{
+    dmessage_cache_t* cache;
+
+    if (!dmessage_mtx)
+	return NULL;
+    if (!(cache = erl_drv_tsd_get(dmessage_key)) && (cache = DZALLOC(sizeof(dmessage_cache_t)))) {
+	erl_drv_mutex_lock(dmessage_mtx);
+	cache->next = dmessage_caches;
+	dmessage_caches = cache;
+	erl_drv_mutex_unlock(dmessage_mtx);
+	erl_drv_tsd_set(dmessage_key, cache);
+    }
+    return cache;
+}
+
+// move (at most) n messages of class c from cache to depot,
+// messages not fitting in the depot are freed
+static void dmessage_cache_drain(dmessage_cache_t* cache, int c, int n)
+{
+    dmessage_t* mp;
+
+    erl_drv_mutex_lock(dmessage_mtx);
+    while(n && (dmessage_ndepot[c] < DMESSAGE_DEPOT_MAX) &&
+	  (mp = cache->free[c])) {
+	cache->free[c] = mp->next;
+	cache->nfree[c]--;
+	mp->next = dmessage_depot[c];
+	dmessage_depot[c] = mp;
+	dmessage_ndepot[c]++;
+	n--;
+    }
+    erl_drv_mutex_unlock(dmessage_mtx);
+
+    while(n-- && (mp = cache->free[c])) {
+	cache->free[c] = mp->next;
+	cache->nfree[c]--;
+	DFREE(mp);
+    }
+}
+
+// move a batch of messages of class c from depot to cache
+static void dmessage_cache_fill(dmessage_cache_t* cache, int c)
+{
+    int n = DMESSAGE_CACHE_BATCH;
+    dmessage_t* mp;
+
+    erl_drv_mutex_lock(dmessage_mtx);
+    while(n-- && (mp = dmessage_depot[c])) {
+	dmessage_depot[c] = mp->next;
+	dmessage_ndepot[c]--;
+	mp->next = cache->free[c];
+	cache->free[c] = mp;
+	cache->nfree[c]++;
+    }
+    erl_drv_mutex_unlock(dmessage_mtx);
+}
+
+// Return the calling thread cache to the depot, called on thread exit
+static void dmessage_cache_release(void)
+{
+    dmessage_cache_t* cache;
+    dmessage_cache_t** pp;
+    int c;
+
+    if (!dmessage_mtx || !(cache = erl_drv_tsd_get(dmessage_key)))
+	return;
+    for (c = 0; c < DMESSAGE_NUM_CLASSES; c++)
+	dmessage_cache_drain(cache, c, cache->nfree[c]);
+    erl_drv_mutex_lock(dmessage_mtx);
+    for (pp = &dmessage_caches; *pp != cache; pp = &(*pp)->next)
+	;
+    *pp = cache->next;
+    erl_drv_mutex_unlock(dmessage_mtx);
+    erl_drv_tsd_set(dmessage_key, NULL);
+    DFREE(cache);
+}
+
 dmessage_t* dmessage_alloc(size_t n)
 {
-    size_t sz = sizeof(dmessage_t) + n;
-    dmessage_t* mp = DZALLOC(sz);
+    int c = dmessage_class(n);
+    dmessage_cache_t* cache;
+    dmessage_t* mp = NULL;
+
+    if (c < 0)
+	mp = DALLOC(sizeof(dmessage_t) + n);
+    else if ((cache = dmessage_cache())) {
+	if (!cache->free[c])
+	    dmessage_cache_fill(cache, c);
+	if ((mp = cache->free[c])) {
+	    cache->free[c] = mp->next;
+	    cache->nfree[c]--;
+	}
+    }
+    if (!mp && (c >= 0))
+	mp = DALLOC(sizeof(dmessage_t) + dmessage_class_size[c]);
     if (mp) {
+	// only the header is cleared, data is written by the caller
+	memset(mp, 0, offsetof(dmessage_t, data));
+	mp->mclass = c;
 	mp->buffer = mp->data;
 	mp->used = 0;
 	mp->size = n;
@@ -74,11 +323,23 @@ dmessage_t* dmessage_alloc(size_t n)
 
 void dmessage_free(dmessage_t* mp)
 {
+    dmessage_cache_t* cache;
+    int c = mp->mclass;
+
     if (mp->release)
 	(*mp->release)(mp);
+    if ((mp->flags & DMESSAGE_REQUEST) && mp->source && mp->source->req_done)
+	(*mp->source->req_done)(mp->source, mp);
     if ((mp->buffer < mp->data) || (mp->buffer > mp->data+mp->size))
 	DFREE(mp->buffer);
-    DFREE(mp);
+    if ((c < 0) || !(cache = dmessage_cache()))
+	DFREE(mp);
+    else {
+	mp->next = cache->free[c];
+	cache->free[c] = mp;
+	if (++cache->nfree[c] > DMESSAGE_CACHE_MAX)
+	    dmessage_cache_drain(cache, c, DMESSAGE_CACHE_BATCH);
+    }
 }
 
 // create a message with optional dynamic buffer
@@ -118,451 +379,3209 @@ dmessage_t* dmessage_create(int cmd,char* buf, size_t len)
 
 /******************************************************************************
  *
- *   Threads
+ *   Input queue
  *
  *****************************************************************************/
 
-extern void dthread_event_close(ErlDrvEvent event)
+// Lane of a message, stop requests always take the high lane
+static inline int iq_lane(dmessage_t* mp)
 {
-    INFOF("event_close: %d", DTHREAD_EVENT(event));
-    DTHREAD_CLOSE_EVENT(event);
+    if ((mp->flags & DMESSAGE_HIGH) || (mp->cmd == DTHREAD_STOP))
+	return DTHREAD_PRIO_HIGH;
+    if (mp->flags & DMESSAGE_BULK)
+	return DTHREAD_PRIO_BULK;
+    return DTHREAD_PRIO_NORMAL;
 }
 
-void dthread_signal_init(dthread_t* thr)
+// Lane to look at in the i:th place. With aging the lanes are looked
+// at from the lowest up on every iq_aging:th receive so bulk work is
+// not starved. Called once per receive with i = 0 (consumer only).
+static inline int iq_lane_order(dthread_t* thr, int i, int* aged)
 {
-    thr->iq_signal[0] = (ErlDrvEvent) DTHREAD_INVALID_EVENT;
-    thr->iq_signal[1] = (ErlDrvEvent) DTHREAD_INVALID_EVENT;
+    if ((i == 0) && (thr->iq_aging > 0))
+	*aged = (thr->iq_served+1 >= thr->iq_aging);
+    return *aged ? (DTHREAD_NUM_PRIO-1-i) : i;
 }
 
-void dthread_signal_select(dthread_t* thr, int on)
+// count served messages only, polls of an empty queue do not age
+static inline dmessage_t* iq_count_served(dthread_t* thr, dmessage_t* mp,
+					      int aged)
 {
-    DEBUGF("dthread_signal_select: fd=%d", 
-	   DTHREAD_EVENT(thr->iq_signal[0]));
-#ifdef __WIN32__
-    driver_select(thr->port,thr->iq_signal[0],ERL_DRV_READ,on);
-#else
-    driver_select(thr->port,thr->iq_signal[0],ERL_DRV_READ,on);
-#endif
+    if (thr->iq_aging > 0) {
+	if (aged)
+	    thr->iq_served = 0;
+	else
+	    thr->iq_served++;
+    }
+    return mp;
 }
 
-void dthread_signal_use(dthread_t* thr, int on)
+#ifdef DTHREAD_HAVE_LOCKFREE
+//
+// Intrusive MPSC queue (Vyukov), one per lane. iq_rear is swapped by
+// producers, iq_front is private to the consumer. iq_stub is linked in
+// when the consumer would otherwise have to unlink the last message.
+//
+// push a linked chain first..last
+static inline void lf_push_chain(dthread_t* thr, int q, dmessage_t* first,
+				 dmessage_t* last)
 {
-#ifdef __WIN32__
-    driver_select(thr->port,thr->iq_signal[0],ERL_DRV_USE,on);
-#else
-    driver_select(thr->port,thr->iq_signal[1],ERL_DRV_USE,on);
-    driver_select(thr->port,thr->iq_signal[0],ERL_DRV_USE,on);
-#endif
-}
+    dmessage_t* prev;
 
+    __atomic_store_n(&last->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&thr->iq_rear[q], last, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, first, __ATOMIC_RELEASE);
+}
 
-int dthread_signal_set(dthread_t* thr)
+static inline void lf_push(dthread_t* thr, int q, dmessage_t* mp)
 {
-#ifdef __WIN32__
-    DEBUGF("dthread_signal_set: handle=%d", DTHREAD_EVENT(thr->iq_signal[0]));
-    SetEvent(DTHREAD_EVENT(thr->iq_signal[0]));
-    return 1;
-#else
-    DEBUGF("dthread_signal_set: fd=%d", DTHREAD_EVENT(thr->iq_signal[1]));
-    return write(DTHREAD_EVENT(thr->iq_signal[1]), "!", 1);
-#endif
+    lf_push_chain(thr, q, mp, mp);
 }
 
-// consume wakeup token
-int dthread_signal_reset(dthread_t* thr)
+static inline dmessage_t* lf_pop_lane(dthread_t* thr, int q)
 {
-#ifdef __WIN32__
-    DEBUGF("dthread_signal_reset: handle=%d", DTHREAD_EVENT(thr->iq_signal[0]));
-    ResetEvent(DTHREAD_EVENT(thr->iq_signal[0]));
-    return 0;
-#else
-    {
-	char buf[1];
-	DEBUGF("dthread_signal_reset: fd=%d", DTHREAD_EVENT(thr->iq_signal[0]));
-	return read(DTHREAD_EVENT(thr->iq_signal[0]), buf, 1);
+    dmessage_t* front = thr->iq_front[q];
+    dmessage_t* next  = __atomic_load_n(&front->next, __ATOMIC_ACQUIRE);
+
+    if (front == &thr->iq_stub[q]) {
+	if (next == NULL)
+	    return NULL;
+	thr->iq_front[q] = front = next;
+	next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
     }
-#endif
+    if (next != NULL) {
+	thr->iq_front[q] = next;
+	return front;
+    }
+    if (front != __atomic_load_n(&thr->iq_rear[q], __ATOMIC_ACQUIRE))
+	return NULL;  // a producer is between exchange and link
+    lf_push(thr, q, &thr->iq_stub[q]);
+    if ((next = __atomic_load_n(&front->next, __ATOMIC_ACQUIRE)) != NULL) {
+	thr->iq_front[q] = next;
+	return front;
+    }
+    return NULL;
 }
 
-void dthread_signal_finish(dthread_t* thr, int and_close)
+static dmessage_t* lf_pop(dthread_t* thr)
 {
-    if (thr->iq_signal[0] != (ErlDrvEvent)DTHREAD_INVALID_EVENT) {
-	if (and_close) {
-	    DEBUGF("dthread_signal_finish: close iq_signal[0]=%d",
-		   DTHREAD_EVENT(thr->iq_signal[0]));
-	    DTHREAD_CLOSE_EVENT(thr->iq_signal[0]);
-	}
-	thr->iq_signal[0] = (ErlDrvEvent)DTHREAD_INVALID_EVENT;
-    }
+    dmessage_t* mp;
+    int i, aged = 0;
 
-    if (thr->iq_signal[1] != (ErlDrvEvent)DTHREAD_INVALID_EVENT) {
-	if (and_close) {
-	    DEBUGF("dthread_signal_finish: iq_signal[1]=%d",
-		   DTHREAD_EVENT(thr->iq_signal[1]));
-	    DTHREAD_CLOSE_EVENT(thr->iq_signal[1]);
-	}
-	thr->iq_signal[1] = (ErlDrvEvent)DTHREAD_INVALID_EVENT;
+    for (i = 0; i < DTHREAD_NUM_PRIO; i++) {
+	if ((mp = lf_pop_lane(thr, iq_lane_order(thr, i, &aged))) != NULL)
+	    return iq_count_served(thr, mp, aged);
     }
+    return NULL;
+}
+
+// The queue was seen empty by a consumer waiting on the signal:
+// consume the wakeup token(s) and set the signal again if a producer
+// got in between (it may have set the signal before we reset it)
+static void lf_rearm(dthread_t* thr)
+{
+    dthread_signal_reset(thr);
+    if (__atomic_load_n(&thr->iq_len, __ATOMIC_SEQ_CST) > 0)
+	dthread_signal_set(thr);
 }
+#endif
 
+// Watermarks, a queue is busy from reaching a high mark until all
+// limited quantities are down to their low marks.
+#define IQ_LIMITED(thr) (((thr)->iq_high_len > 0) || ((thr)->iq_high_bytes > 0))
 
-// Cleanup the mess
-void dthread_finish(dthread_t* thr)
+static inline int iq_over_high(dthread_t* thr, int len, size_t bytes)
 {
-    dmessage_t* mp;
+    return ((thr->iq_high_len > 0) && (len >= thr->iq_high_len)) ||
+	((thr->iq_high_bytes > 0) && (bytes >= thr->iq_high_bytes));
+}
 
-    if (thr->iq_mtx) {
-	erl_drv_mutex_destroy(thr->iq_mtx);
-	thr->iq_mtx = NULL;
-    }
-    mp = thr->iq_front;
-    while(mp) {
-	dmessage_t* tmp = mp->next;
-	dmessage_free(mp);
-	mp = tmp;
-    }
-    thr->iq_front = thr->iq_rear = NULL;
-    dthread_signal_finish(thr, 0);
+static inline int iq_under_low(dthread_t* thr, int len, size_t bytes)
+{
+    return ((thr->iq_high_len == 0) || (len <= thr->iq_low_len)) &&
+	((thr->iq_high_bytes == 0) || (bytes <= thr->iq_low_bytes));
 }
 
-// Initialize thread structure
-int dthread_init(dthread_t* thr, ErlDrvPort port)
+// Tell the sender that the queue is no longer busy
+static void iq_notify_low(dthread_t* thr, dthread_t* target)
 {
-    ErlDrvSysInfo sys_info;
+    dmessage_t* mp;
 
-    memset(thr, 0, sizeof(dthread_t));
-    dthread_signal_init(thr);
-    driver_system_info(&sys_info, sizeof(ErlDrvSysInfo));
-    // smp_support is used for message passing from thread to
-    // calling process. if SMP is supported the message will go
-    // directly to sender, otherwise it must be sent to port 
-    thr->smp_support = sys_info.smp_support;
-    thr->port = port;
-    thr->dport = driver_mk_port(port);
-    thr->owner = driver_connected(port);
+    DEBUGF("dthread: queue low len=%d, bytes=%lu",
+	   thr->iq_len, (unsigned long) thr->iq_bytes);
+    if (target && (mp = dmessage_create(DTHREAD_QUEUE_LOW, NULL, 0)))
+	dthread_send(target, thr, mp);
+}
 
-    if (!(thr->iq_mtx = erl_drv_mutex_create("iq_mtx")))
-	return -1;
-#ifdef __WIN32__
-    // create a manual reset event
-    if (!(thr->iq_signal[0] = (ErlDrvEvent)
-	  CreateEvent(NULL, TRUE, FALSE, NULL))) {
-	dthread_finish(thr);
-	return -1;
-    }
-    DEBUGF("dthread_init: handle=%d", DTHREAD_EVENT(thr->iq_signal[0]));
-#else
-    {
-	int pfd[2];
-	if (pipe(pfd) < 0) {
-	    dthread_finish(thr);
-	    return -1;
-	}
-	DEBUGF("dthread_init: pipe[0]=%d,pidp[1]=%d", pfd[0], pfd[1]);
-	thr->iq_signal[0] = (ErlDrvEvent) ((long)pfd[0]);
-	thr->iq_signal[1] = (ErlDrvEvent) ((long)pfd[1]);
-	INFOF("pipe: %d,%d", pfd[0], pfd[1]);
+#ifdef DTHREAD_HAVE_LOCKFREE
+// Producer: set busy when crossing a high mark. The consumer may have
+// drained the queue before busy was set without seeing it, recheck.
+static void lf_check_high(dthread_t* thr, int len, size_t bytes)
+{
+    int busy = 0;
+
+    if (!iq_over_high(thr, len, bytes) ||
+	__atomic_load_n(&thr->iq_busy, __ATOMIC_SEQ_CST))
+	return;
+    if (__atomic_compare_exchange_n(&thr->iq_busy, &busy, 1, 0,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+	len = __atomic_load_n(&thr->iq_len, __ATOMIC_SEQ_CST);
+	bytes = __atomic_load_n(&thr->iq_bytes, __ATOMIC_SEQ_CST);
+	busy = 1;
+	if (iq_under_low(thr, len, bytes))
+	    __atomic_compare_exchange_n(&thr->iq_busy, &busy, 0, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
     }
-#endif
-    return 0;
 }
 
-dthread_t* dthread_start(ErlDrvPort port,
-			 void* (*func)(void* arg),
-			 void* arg, int stack_size)
+// Consumer: clear busy when down at low marks, return 1 if cleared
+static int lf_check_low(dthread_t* thr, int len, size_t bytes)
 {
-    ErlDrvThreadOpts* opts = NULL;
-    dthread_t* thr = NULL;
-
-    if (!(thr = DALLOC(sizeof(dthread_t))))
-	return 0;
+    int busy = 1;
 
-    if (dthread_init(thr, port) < 0)
-	goto error;
+    return __atomic_load_n(&thr->iq_busy, __ATOMIC_SEQ_CST) &&
+	iq_under_low(thr, len, bytes) &&
+	__atomic_compare_exchange_n(&thr->iq_busy, &busy, 0, 0,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+#endif
 
-    if (!(opts = erl_drv_thread_opts_create("dthread_opts")))
-	goto error;
+// Pop the front message of lane q, the queue lock must be held (mutex
+// mode). *low is set when the pop cleared the busy state
+static dmessage_t* mq_pop_lane(dthread_t* thr, int q, int* low)
+{
+    dmessage_t* mp;
 
-    opts->suggested_stack_size = stack_size;
-    thr->arg = arg;
+    if ((mp = thr->iq_front[q]) != NULL) {
+	if (!(thr->iq_front[q] = mp->next))
+	    thr->iq_rear[q] = NULL;
+	thr->iq_len--;
+	thr->iq_bytes -= mp->used;
+	if ((thr->iq_len == 0) && thr->iq_sleeping)
+	    dthread_signal_reset(thr);
+	if (thr->iq_busy && iq_under_low(thr, thr->iq_len, thr->iq_bytes)) {
+	    thr->iq_busy = 0;
+	    *low = 1;
+	}
+    }
+    return mp;
+}
 
-    if (erl_drv_thread_create("dthread", &thr->tid, func, thr, opts) < 0)
-	goto error;
-    erl_drv_thread_opts_destroy(opts);
-    return thr;
+static dmessage_t* mq_pop(dthread_t* thr, int* low)
+{
+    dmessage_t* mp;
+    int i, aged = 0;
 
-error:
-    dthread_finish(thr);
-    if (opts)
-        erl_drv_thread_opts_destroy(opts);
-    dthread_finish(thr);
-    DFREE(thr);
-    return 0;
+    for (i = 0; i < DTHREAD_NUM_PRIO; i++) {
+	if ((mp = mq_pop_lane(thr, iq_lane_order(thr, i, &aged), low)))
+	    return iq_count_served(thr, mp, aged);
+    }
+    return NULL;
 }
 
-int dthread_stop(dthread_t* target, dthread_t* source, 
-		 void** exit_value)
+// Select queue implementation, only while the queue is empty
+// return previous mode or -1 on error
+int dthread_queue_mode(dthread_t* thr, int mode)
 {
-    dmessage_t* mp;
-    int r;
+    int old_mode = thr->iq_mode;
 
-    if (!(mp = dmessage_create(DTHREAD_STOP, NULL, 0)))
+    int q;
+
+    if (thr->iq_len != 0)
 	return -1;
-    dthread_send(target, source, mp);
+    switch(mode) {
+    case DTHREAD_QUEUE_MUTEX:
+	for (q = 0; q < DTHREAD_NUM_PRIO; q++)
+	    thr->iq_front[q] = thr->iq_rear[q] = NULL;
+	break;
+#ifdef DTHREAD_HAVE_LOCKFREE
+    case DTHREAD_QUEUE_LOCKFREE:
+	for (q = 0; q < DTHREAD_NUM_PRIO; q++) {
+	    thr->iq_stub[q].next = NULL;
+	    thr->iq_front[q] = thr->iq_rear[q] = &thr->iq_stub[q];
+	}
+	break;
+#endif
+    default:
+	return -1;
+    }
+    thr->iq_mode = mode;
+    return old_mode;
+}
 
-    DEBUGF("dthread_stop: wait to join");
-    r = erl_drv_thread_join(target->tid, exit_value);
-    DEBUGF("dthread_stop: thread_join: return=%d, exit_value=%p", r, *exit_value);
+// Set queue watermarks, by message count and by bytes of message data,
+// low marks should be below the high marks. A high mark of 0 disables
+// that limit. The queue is marked busy when a high mark is reached and
+// a DTHREAD_QUEUE_LOW message is sent to the source of the message that
+// brings it back to the low marks.
+void dthread_queue_limits(dthread_t* thr, int low_len, int high_len,
+			  size_t low_bytes, size_t high_bytes)
+{
+    thr->iq_low_len = low_len;
+    thr->iq_high_len = high_len;
+    thr->iq_low_bytes = low_bytes;
+    thr->iq_high_bytes = high_bytes;
+}
 
-    dthread_signal_finish(target, 1);
-    dthread_finish(target);
-    DFREE(target);
-    return 0;
+// Serve the lowest non-empty lane first on every n:th receive, 0 = off
+void dthread_queue_aging(dthread_t* thr, int n)
+{
+    thr->iq_aging = (n < 0) ? 0 : n;
+    thr->iq_served = 0;
 }
 
-void dthread_exit(void* value)
+// Select the lane of a message before it is sent
+void dmessage_set_prio(dmessage_t* mp, int prio)
 {
-    erl_drv_thread_exit(value);
+    mp->flags &= ~(DMESSAGE_HIGH|DMESSAGE_BULK);
+    if (prio == DTHREAD_PRIO_HIGH)
+	mp->flags |= DMESSAGE_HIGH;
+    else if (prio == DTHREAD_PRIO_BULK)
+	mp->flags |= DMESSAGE_BULK;
 }
 
-//
-// Poll dthread queue and optionally other INPUT! events given by events
-// number of input events are given in *nevents and number of ready
-// events are also outputed there. 
-//
+int dthread_queue_busy(dthread_t* thr)
+{
+#ifdef DTHREAD_HAVE_LOCKFREE
+    return __atomic_load_n(&thr->iq_busy, __ATOMIC_SEQ_CST);
+#else
+    int busy;
+    erl_drv_mutex_lock(thr->iq_mtx);
+    busy = thr->iq_busy;
+    erl_drv_mutex_unlock(thr->iq_mtx);
+    return busy;
+#endif
+}
+
+// Requests that may be withdrawn with dthread_cancel/dthread_purge,
+// wp is the DTHREAD_CANCEL or DTHREAD_PURGE request
+static int iq_withdraw_match(dmessage_t* mp, dmessage_t* wp)
+{
+    if ((mp->cmd <= 0) && (mp->cmd != DTHREAD_OUTPUT))
+	return 0;
+    if (wp->cmd == DTHREAD_CANCEL)  // refs are 32 bit on the wire
+	return (mp->source == wp->source) && (mp->from == wp->from) &&
+	    ((uint32_t) mp->ref == (uint32_t) wp->ref);
+    return (mp->from == wp->from);
+}
+
+#ifdef DTHREAD_HAVE_LOCKFREE
+// Consumer: mark queued messages matching wp, they are dropped when
+// received. Only the consumer walk the lanes, producers never touch
+// a message once it is linked.
+static void lf_withdraw(dthread_t* thr, dmessage_t* wp)
+{
+    int q;
+
+    for (q = 0; q < DTHREAD_NUM_PRIO; q++) {
+	dmessage_t* mp = thr->iq_front[q];
+
+	while(mp != NULL) {
+	    if ((mp != &thr->iq_stub[q]) && iq_withdraw_match(mp, wp))
+		mp->flags |= DMESSAGE_CANCELLED;
+	    mp = __atomic_load_n(&mp->next, __ATOMIC_ACQUIRE);
+	}
+    }
+}
+
+// Consumer: handle withdraw requests, return 1 if mp should be dropped
+static int lf_dropped(dthread_t* thr, dmessage_t* mp)
+{
+    if ((mp->cmd == DTHREAD_CANCEL) || (mp->cmd == DTHREAD_PURGE)) {
+	lf_withdraw(thr, mp);
+	return 1;
+    }
+    return (mp->flags & DMESSAGE_CANCELLED) != 0;
+}
+#endif
+
+int dthread_send(dthread_t* thr, dthread_t* source, dmessage_t* mp)
+{
+    dmessage_t* mr;
+    int q = iq_lane(mp);
+    int len;
+    int r = 0;
+
+    mp->next = NULL;
+    mp->source = source;
+
+#ifdef DTHREAD_HAVE_LOCKFREE
+    if (thr->iq_mode == DTHREAD_QUEUE_LOCKFREE) {
+	// count first, so iq_len never is less than the number of
+	// messages the consumer can see
+	size_t bytes;
+
+	len = __atomic_add_fetch(&thr->iq_len, 1, __ATOMIC_SEQ_CST);
+	bytes = __atomic_add_fetch(&thr->iq_bytes, mp->used, __ATOMIC_SEQ_CST);
+	lf_push(thr, q, mp);
+	if ((len == 1) && __atomic_load_n(&thr->iq_sleeping, __ATOMIC_SEQ_CST))
+	    r = dthread_signal_set(thr);
+	if (IQ_LIMITED(thr))
+	    lf_check_high(thr, len, bytes);
+	DEBUGF("dthread_send: iq_len=%d", len);
+	return r;
+    }
+#endif
+    erl_drv_mutex_lock(thr->iq_mtx);
+
+    if ((mr = thr->iq_rear[q]) != NULL)
+	mr->next = mp;
+    else
+	thr->iq_front[q] = mp;
+    thr->iq_rear[q] = mp;
+    len = ++thr->iq_len;
+    thr->iq_bytes += mp->used;
+    if ((len == 1) && thr->iq_sleeping)
+	r = dthread_signal_set(thr);
+    if (!thr->iq_busy && iq_over_high(thr, len, thr->iq_bytes))
+	thr->iq_busy = 1;
+    erl_drv_mutex_unlock(thr->iq_mtx);
+    DEBUGF("dthread_send: iq_len=%d", len);
+    return r;
+}
+
+#ifdef DTHREAD_HAVE_LOCKFREE
+static dmessage_t* lf_recv(dthread_t* thr)
+{
+    dmessage_t* mp;
+
+    // an awake dthread_poll consumer leaves the signal to dthread_poll
+    if ((mp = lf_pop(thr)) != NULL) {
+	size_t bytes;
+	int len;
+
+	bytes = __atomic_sub_fetch(&thr->iq_bytes, mp->used, __ATOMIC_SEQ_CST);
+	len = __atomic_sub_fetch(&thr->iq_len, 1, __ATOMIC_SEQ_CST);
+	if ((len == 0) && __atomic_load_n(&thr->iq_sleeping, __ATOMIC_SEQ_CST))
+	    lf_rearm(thr);
+	if (lf_check_low(thr, len, bytes))
+	    iq_notify_low(thr, mp->source);
+    }
+    else if ((__atomic_load_n(&thr->iq_len, __ATOMIC_SEQ_CST) == 0) &&
+	     __atomic_load_n(&thr->iq_sleeping, __ATOMIC_SEQ_CST))
+	lf_rearm(thr);  // stale wakeup
+    return mp;
+}
+#endif
+
+dmessage_t* dthread_recv(dthread_t* thr, dthread_t** source)
+{
+    dmessage_t* mp;
+    int low = 0;
+
+#ifdef DTHREAD_HAVE_LOCKFREE
+    if (thr->iq_mode == DTHREAD_QUEUE_LOCKFREE) {
+	while(((mp = lf_recv(thr)) != NULL) && lf_dropped(thr, mp))
+	    dmessage_free(mp);
+    }
+    else
+#endif
+    {
+	erl_drv_mutex_lock(thr->iq_mtx);
+	mp = mq_pop(thr, &low);
+	erl_drv_mutex_unlock(thr->iq_mtx);
+	if (low)
+	    iq_notify_low(thr, mp->source);
+    }
+    if (mp == NULL) {
+	if (thr->replies)  // queue is empty, send coalesced replies
+	    dthread_reply_flush(thr);
+    }
+    else if (source)
+	*source = mp->source;
+    return mp;
+}
+
+
+//
+// Send a chain of n messages, first..last linked with next, with one
+// lock (or one exchange) and at most one signal. All messages are
+// queued in the lane of the first message.
+//
+int dthread_send_batch(dthread_t* thr, dthread_t* source,
+		       dmessage_t* first, dmessage_t* last, int n)
+{
+    dmessage_t* mp;
+    size_t bytes = 0;
+    int q = iq_lane(first);
+    int len;
+    int r = 0;
+
+    if (n <= 0)
+	return 0;
+    for (mp = first; mp != last; mp = mp->next) {
+	mp->source = source;
+	bytes += mp->used;
+    }
+    last->source = source;
+    last->next = NULL;
+    bytes += last->used;
+
+#ifdef DTHREAD_HAVE_LOCKFREE
+    if (thr->iq_mode == DTHREAD_QUEUE_LOCKFREE) {
+	len = __atomic_add_fetch(&thr->iq_len, n, __ATOMIC_SEQ_CST);
+	bytes = __atomic_add_fetch(&thr->iq_bytes, bytes, __ATOMIC_SEQ_CST);
+	lf_push_chain(thr, q, first, last);
+	if ((len == n) && __atomic_load_n(&thr->iq_sleeping, __ATOMIC_SEQ_CST))
+	    r = dthread_signal_set(thr);
+	if (IQ_LIMITED(thr))
+	    lf_check_high(thr, len, bytes);
+	DEBUGF("dthread_send_batch: n=%d, iq_len=%d", n, len);
+	return r;
+    }
+#endif
+    erl_drv_mutex_lock(thr->iq_mtx);
+    if (thr->iq_rear[q] != NULL)
+	thr->iq_rear[q]->next = first;
+    else
+	thr->iq_front[q] = first;
+    thr->iq_rear[q] = last;
+    thr->iq_len += n;
+    len = thr->iq_len;
+    thr->iq_bytes += bytes;
+    if ((len == n) && thr->iq_sleeping)
+	r = dthread_signal_set(thr);
+    if (!thr->iq_busy && iq_over_high(thr, len, thr->iq_bytes))
+	thr->iq_busy = 1;
+    erl_drv_mutex_unlock(thr->iq_mtx);
+    DEBUGF("dthread_send_batch: n=%d, iq_len=%d", n, len);
+    return r;
+}
+
+//
+// Detach all queued messages, return them as a chain linked with next
+// (in lane and queue order). source is set to the source of the first
+// message.
+//
+dmessage_t* dthread_recv_all(dthread_t* thr, dthread_t** source)
+{
+    dmessage_t* first = NULL;
+    int low = 0;
+
+#ifdef DTHREAD_HAVE_LOCKFREE
+    if (thr->iq_mode == DTHREAD_QUEUE_LOCKFREE) {
+	dmessage_t** pp = &first;
+	dmessage_t* dropped = NULL;
+	dmessage_t* mp;
+	size_t bytes = 0;
+	int q, len, n = 0;
+
+	for (q = 0; q < DTHREAD_NUM_PRIO; q++) {
+	    while((mp = lf_pop_lane(thr, q)) != NULL) {
+		bytes += mp->used;
+		n++;
+		*pp = mp;
+		pp = &mp->next;
+		if ((mp->cmd == DTHREAD_CANCEL) || (mp->cmd == DTHREAD_PURGE)) {
+		    dmessage_t* mq;
+		    for (mq = first; mq != mp; mq = mq->next) {
+			if (iq_withdraw_match(mq, mp))
+			    mq->flags |= DMESSAGE_CANCELLED;
+		    }
+		    lf_withdraw(thr, mp);
+		}
+	    }
+	}
+	*pp = NULL;
+	// unlink withdraw requests and withdrawn messages
+	pp = &first;
+	while((mp = *pp) != NULL) {
+	    if ((mp->flags & DMESSAGE_CANCELLED) ||
+		(mp->cmd == DTHREAD_CANCEL) || (mp->cmd == DTHREAD_PURGE)) {
+		*pp = mp->next;
+		mp->next = dropped;
+		dropped = mp;
+	    }
+	    else
+		pp = &mp->next;
+	}
+	bytes = __atomic_sub_fetch(&thr->iq_bytes, bytes, __ATOMIC_SEQ_CST);
+	len = __atomic_sub_fetch(&thr->iq_len, n, __ATOMIC_SEQ_CST);
+	if ((len == 0) && __atomic_load_n(&thr->iq_sleeping, __ATOMIC_SEQ_CST))
+	    lf_rearm(thr);
+	if (lf_check_low(thr, len, bytes) && (n > 0))
+	    iq_notify_low(thr, first ? first->source : dropped->source);
+	while((mp = dropped) != NULL) {
+	    dropped = mp->next;
+	    dmessage_free(mp);
+	}
+    }
+    else
+#endif
+    {
+	dmessage_t** pp = &first;
+	int q;
+
+	erl_drv_mutex_lock(thr->iq_mtx);
+	for (q = 0; q < DTHREAD_NUM_PRIO; q++) {
+	    if (thr->iq_front[q] != NULL) {
+		*pp = thr->iq_front[q];
+		pp = &thr->iq_rear[q]->next;
+		thr->iq_front[q] = thr->iq_rear[q] = NULL;
+	    }
+	}
+	*pp = NULL;
+	if (first != NULL) {
+	    thr->iq_len = 0;
+	    thr->iq_bytes = 0;
+	    if (thr->iq_sleeping)
+		dthread_signal_reset(thr);
+	    low = thr->iq_busy;
+	    thr->iq_busy = 0;
+	}
+	erl_drv_mutex_unlock(thr->iq_mtx);
+    }
+    if (low && first)
+	iq_notify_low(thr, first->source);
+    if (first && source)
+	*source = first->source;
+    return first;
+}
+
+// Unlink queued messages matching wp, the queue lock must be held
+// (mutex mode). The removed messages are returned in *dropped.
+static int mq_withdraw(dthread_t* thr, dmessage_t* wp, dmessage_t** dropped,
+		       int* low)
+{
+    int q, n = 0;
+
+    for (q = 0; q < DTHREAD_NUM_PRIO; q++) {
+	dmessage_t** pp = &thr->iq_front[q];
+	dmessage_t* prev = NULL;
+	dmessage_t* mp;
+
+	while((mp = *pp) != NULL) {
+	    if (!iq_withdraw_match(mp, wp)) {
+		prev = mp;
+		pp = &mp->next;
+		continue;
+	    }
+	    if ((*pp = mp->next) == NULL)
+		thr->iq_rear[q] = prev;
+	    thr->iq_len--;
+	    thr->iq_bytes -= mp->used;
+	    mp->next = *dropped;
+	    *dropped = mp;
+	    n++;
+	}
+    }
+    if (n > 0) {
+	if ((thr->iq_len == 0) && thr->iq_sleeping)
+	    dthread_signal_reset(thr);
+	if (thr->iq_busy && iq_under_low(thr, thr->iq_len, thr->iq_bytes)) {
+	    thr->iq_busy = 0;
+	    *low = 1;
+	}
+    }
+    return n;
+}
+
+// Withdraw queued requests matching a DTHREAD_CANCEL/DTHREAD_PURGE
+// request. In mutex mode they are removed at once, in lock-free mode
+// only the consumer may look at the queue so wp is queued in the high
+// lane and matching messages are dropped by the consumer.
+static int iq_withdraw(dthread_t* thr, dthread_t* source, int cmd,
+		       ErlDrvTermData ref, ErlDrvTermData pid)
+{
+    dmessage_t w;
+    dmessage_t* dropped = NULL;
+    dmessage_t* mp;
+    int n, low = 0;
+
+#ifdef DTHREAD_HAVE_LOCKFREE
+    if (thr->iq_mode == DTHREAD_QUEUE_LOCKFREE) {
+	if (!(mp = dmessage_create(cmd, NULL, 0)))
+	    return -1;
+	mp->ref  = ref;
+	mp->from = pid;
+	mp->flags |= DMESSAGE_HIGH;
+	return (dthread_send(thr, source, mp) < 0) ? -1 : 0;
+    }
+#endif
+    memset(&w, 0, sizeof(w));
+    w.cmd    = cmd;
+    w.source = source;
+    w.ref    = ref;
+    w.from   = pid;
+    erl_drv_mutex_lock(thr->iq_mtx);
+    n = mq_withdraw(thr, &w, &dropped, &low);
+    erl_drv_mutex_unlock(thr->iq_mtx);
+    if (low)
+	iq_notify_low(thr, source);
+    while((mp = dropped) != NULL) {
+	dropped = mp->next;
+	dmessage_free(mp);
+    }
+    DEBUGF("dthread: withdraw cmd=%d, removed=%d", cmd, n);
+    return n;
+}
+
+//
+// Cancel the queued request with ref (as set by dthread_control and
+// friends from source->ref, compared on the low 32 bits) sent by
+// caller. Purge drop all queued requests from pid.
+// Only user commands and DTHREAD_OUTPUT are withdrawn, a request that
+// a worker already has received is not affected.
+// Return the number of removed messages, 0 if the lock-free consumer
+// will drop them later, or -1 on error.
+//
+int dthread_cancel(dthread_t* thr, dthread_t* source, ErlDrvTermData ref,
+		   ErlDrvTermData caller)
+{
+    return iq_withdraw(thr, source, DTHREAD_CANCEL, ref, caller);
+}
+
+int dthread_purge(dthread_t* thr, dthread_t* source, ErlDrvTermData pid)
+{
+    return iq_withdraw(thr, source, DTHREAD_PURGE, 0, pid);
+}
+
+/******************************************************************************
+ *
+ *   Timers
+ *
+ *****************************************************************************/
+
+//
+// Hierarchical timing wheel, TW_LEVELS levels of TW_SLOTS slots. Level l
+// holds timers expiring within TW_SLOTS^(l+1) ticks, they are moved
+// (cascaded) down a level when time reach the start of their slot.
+// A bitmap of non-empty slots per level gives the next tick where
+// something must be done, so idle ticks are skipped.
+//
+#define TW_TICK    100   // tick length in microseconds
+#define TW_BITS    6
+#define TW_SLOTS   (1 << TW_BITS)
+#define TW_MASK    (TW_SLOTS-1)
+#define TW_LEVELS  6     // 2^36 ticks, about 80 days
+
+typedef struct _dthread_timers_t {
+    ErlDrvTime   base;                 // monotonic time (usec) at tick 0
+    ErlDrvUInt64 now;                  // current tick
+    int          count;                // number of running timers
+    ErlDrvUInt64 used[TW_LEVELS];      // non-empty slots
+    dthread_timer_t* slot[TW_LEVELS][TW_SLOTS];
+} dthread_timers_t;
+
+// index of lowest bit set in x (x != 0)
+static inline int tw_ffs(ErlDrvUInt64 x)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int i = 0;
+    while(!(x & 1)) {
+	x >>= 1;
+	i++;
+    }
+    return i;
+#endif
+}
+
+static void tw_link(dthread_timers_t* tw, int l, int j, dthread_timer_t* t)
+{
+    if ((t->next = tw->slot[l][j]) != NULL)
+	t->next->pprev = &t->next;
+    tw->slot[l][j] = t;
+    t->pprev = &tw->slot[l][j];
+    tw->used[l] |= ((ErlDrvUInt64) 1 << j);
+}
+
+static void tw_unlink(dthread_timers_t* tw, dthread_timer_t* t)
+{
+    dthread_timer_t** first = &tw->slot[0][0];
+    dthread_timer_t** pprev = t->pprev;
+
+    if ((*pprev = t->next) != NULL)
+	t->next->pprev = pprev;
+    else if ((pprev >= first) && (pprev < first + TW_LEVELS*TW_SLOTS)) {
+	int i = (int) (pprev - first);  // t was alone in the slot
+	tw->used[i / TW_SLOTS] &= ~((ErlDrvUInt64) 1 << (i % TW_SLOTS));
+    }
+    t->pprev = NULL;
+}
+
+static void tw_insert(dthread_timers_t* tw, dthread_timer_t* t)
+{
+    ErlDrvUInt64 delta;
+    int l;
+
+    if (t->expire < tw->now)
+	t->expire = tw->now;
+    delta = t->expire - tw->now;
+    for (l = 0; l < TW_LEVELS-1; l++) {
+	if (delta < ((ErlDrvUInt64) 1 << (TW_BITS*(l+1))))
+	    break;
+    }
+    if (delta >= ((ErlDrvUInt64) 1 << (TW_BITS*TW_LEVELS)))
+	t->expire = tw->now + ((ErlDrvUInt64) 1 << (TW_BITS*TW_LEVELS)) - 1;
+    tw_link(tw, l, (int) ((t->expire >> (TW_BITS*l)) & TW_MASK), t);
+}
+// Detach all timers in a slot, the list head is moved to *list
+static void tw_detach(dthread_timers_t* tw, int l, int j,
+		      dthread_timer_t** list)
+{
+    if ((*list = tw->slot[l][j]) != NULL)
+	(*list)->pprev = list;
+    tw->slot[l][j] = NULL;
+    tw->used[l] &= ~((ErlDrvUInt64) 1 << j);
+}
+
+// The next tick where a level 0 slot expire or a slot is cascaded
+static ErlDrvUInt64 tw_next_tick(dthread_timers_t* tw)
+{
+    ErlDrvUInt64 next = ~((ErlDrvUInt64) 0);
+    int l;
+
+    for (l = 0; l < TW_LEVELS; l++) {
+	int shift = TW_BITS*l;
+	int p = (int) ((tw->now >> shift) & TW_MASK);
+	ErlDrvUInt64 used = tw->used[l];
+	ErlDrvUInt64 after, t;
+
+	if (!used)
+	    continue;
+	// slots after the current one are in this turn of the level
+	after = (p == TW_MASK) ? 0 : (used & (~((ErlDrvUInt64) 0) << (p+1)));
+	t = (tw->now >> (shift+TW_BITS)) << (shift+TW_BITS);
+	if (after)
+	    t += (ErlDrvUInt64) tw_ffs(after) << shift;
+	else
+	    t += ((ErlDrvUInt64) 1 << (shift+TW_BITS)) +
+		((ErlDrvUInt64) tw_ffs(used) << shift);
+	if (t < next)
+	    next = t;
+    }
+    return next;
+}
+
+// Run the current tick, cascade slots starting here and fire the timers
+// in the level 0 slot. Callbacks may start and cancel timers.
+static int tw_tick(dthread_t* thr, dthread_timers_t* tw)
+{
+    dthread_timer_t* list;
+    dthread_timer_t* t;
+    int l, n = 0;
+
+    for (l = 1; l < TW_LEVELS; l++) {
+	if (tw->now & (((ErlDrvUInt64) 1 << (TW_BITS*l)) - 1))
+	    break;
+	tw_detach(tw, l, (int) ((tw->now >> (TW_BITS*l)) & TW_MASK), &list);
+	while((t = list) != NULL) {
+	    tw_unlink(tw, t);
+	    tw_insert(tw, t);
+	}
+    }
+    tw_detach(tw, 0, (int) (tw->now & TW_MASK), &list);
+    while((t = list) != NULL) {
+	tw_unlink(tw, t);
+	if (t->expire > tw->now) {  // clamped far timer
+	    tw_insert(tw, t);
+	    continue;
+	}
+	tw->count--;
+	n++;
+	if (t->cb)
+	    (*t->cb)(thr, t, t->arg);
+	else {
+	    dmessage_t* mp;
+	    if ((mp = dmessage_create(DTHREAD_TIMEOUT, NULL, 0))) {
+		mp->udata = t->arg;
+		mp->flags |= DMESSAGE_KEYED;  // udata is ours, never stolen
+		dthread_send(thr, thr, mp);
+	    }
+	}
+    }
+    return n;
+}
+
+static ErlDrvUInt64 tw_ticks(dthread_timers_t* tw, ErlDrvTime usec)
+{
+    return (usec <= tw->base) ? 0 : (ErlDrvUInt64) (usec - tw->base) / TW_TICK;
+}
+
+// Microseconds from now to the next tick to run, -1 if no timers
+static ErlDrvTime tw_next_usec(dthread_timers_t* tw, ErlDrvTime now)
+{
+    ErlDrvTime t;
+
+    if (!tw || !tw->count)
+	return -1;
+    t = tw->base + (ErlDrvTime) tw_next_tick(tw) * TW_TICK;
+    return (t > now) ? (t - now) : 0;
+}
+
+#if defined(DTHREAD_HAVE_EPOLL) || defined(DTHREAD_HAVE_IO_URING)
+// Cap a wait timeout in milliseconds (-1 = infinity) by the next timer,
+// rounded up so the wait does not spin before the tick
+static int tw_wait_timeout(dthread_t* thr, int timeout)
+{
+    ErlDrvTime tmo;
+    int ms;
+
+    tmo = tw_next_usec(thr->timers, erl_drv_monotonic_time(ERL_DRV_USEC));
+    if (tmo < 0)
+	return timeout;
+    tmo = (tmo + 999) / 1000;
+    ms = (tmo > 0x7fffffff) ? 0x7fffffff : (int) tmo;
+    return ((timeout < 0) || (ms < timeout)) ? ms : timeout;
+}
+#endif
+
+//
+// Start (or restart) a timer expiring in usec microseconds. When it
+// expires cb is called from dthread_poll (or dthread_timer_expire), with
+// no callback a DTHREAD_TIMEOUT message with udata = arg is sent to thr.
+// Only the thread owning thr may use its timers.
+//
+int dthread_timer_start(dthread_t* thr, dthread_timer_t* t,
+			ErlDrvTime usec, dthread_timer_cb_t cb, void* arg)
+{
+    dthread_timers_t* tw;
+    ErlDrvTime now = erl_drv_monotonic_time(ERL_DRV_USEC);
+
+    if (!(tw = thr->timers)) {
+	if (!(tw = DZALLOC(sizeof(dthread_timers_t))))
+	    return -1;
+	tw->base = now;
+	thr->timers = tw;
+    }
+    if (t->pprev)
+	dthread_timer_cancel(thr, t);
+    if (usec < 0)
+	usec = 0;
+    t->cb = cb;
+    t->arg = arg;
+    t->expire = tw_ticks(tw, now + usec + TW_TICK - 1);
+    if (t->expire <= tw->now)
+	t->expire = tw->now + 1;
+    tw_insert(tw, t);
+    tw->count++;
+    return 0;
+}
+
+// Cancel a timer, return 1 if it was running 0 otherwise
+int dthread_timer_cancel(dthread_t* thr, dthread_timer_t* t)
+{
+    if (!thr->timers || !t->pprev)
+	return 0;
+    tw_unlink(thr->timers, t);
+    thr->timers->count--;
+    return 1;
+}
+
+// Run expired timers, return the number of timers expired
+int dthread_timer_expire(dthread_t* thr)
+{
+    dthread_timers_t* tw = thr->timers;
+    ErlDrvUInt64 now;
+    int n = 0;
+
+    if (!tw)
+	return 0;
+    now = tw_ticks(tw, erl_drv_monotonic_time(ERL_DRV_USEC));
+    while(tw->now < now) {
+	ErlDrvUInt64 next;
+
+	if (!tw->count || ((next = tw_next_tick(tw)) > now)) {
+	    tw->now = now;
+	    break;
+	}
+	tw->now = next;
+	n += tw_tick(thr, tw);
+    }
+    return n;
+}
+
+// Microseconds until the next timer expire, -1 if no timers are running
+ErlDrvTime dthread_timer_next(dthread_t* thr)
+{
+    return tw_next_usec(thr->timers,erl_drv_monotonic_time(ERL_DRV_USEC));
+}
+
+// Release the timer wheel, running timers are forgotten
+void dthread_timer_finish(dthread_t* thr)
+{
+    if (thr->timers) {
+	DFREE(thr->timers);
+	thr->timers = NULL;
+    }
+}
+
+/******************************************************************************
+ *
+ *   Threads
+ *
+ *****************************************************************************/
+
+extern void dthread_event_close(ErlDrvEvent event)
+{
+    INFOF("event_close: %d", DTHREAD_EVENT(event));
+    DTHREAD_CLOSE_EVENT(event);
+}
+
+void dthread_signal_init(dthread_t* thr)
+{
+    thr->iq_signal[0] = (ErlDrvEvent) DTHREAD_INVALID_EVENT;
+    thr->iq_signal[1] = (ErlDrvEvent) DTHREAD_INVALID_EVENT;
+}
+
+void dthread_signal_select(dthread_t* thr, int on)
+{
+    DEBUGF("dthread_signal_select: fd=%d", 
+	   DTHREAD_EVENT(thr->iq_signal[0]));
+#ifdef __WIN32__
+    driver_select(thr->port,thr->iq_signal[0],ERL_DRV_READ,on);
+#else
+    driver_select(thr->port,thr->iq_signal[0],ERL_DRV_READ,on);
+#endif
+}
+
+void dthread_signal_use(dthread_t* thr, int on)
+{
+#ifdef __WIN32__
+    driver_select(thr->port,thr->iq_signal[0],ERL_DRV_USE,on);
+#else
+    // iq_signal[1] is not used with eventfd
+    if (thr->iq_signal[1] != (ErlDrvEvent)DTHREAD_INVALID_EVENT)
+	driver_select(thr->port,thr->iq_signal[1],ERL_DRV_USE,on);
+    driver_select(thr->port,thr->iq_signal[0],ERL_DRV_USE,on);
+#endif
+}
+
+
+int dthread_signal_set(dthread_t* thr)
+{
+#ifdef __WIN32__
+    DEBUGF("dthread_signal_set: handle=%d", DTHREAD_EVENT(thr->iq_signal[0]));
+    SetEvent(DTHREAD_EVENT(thr->iq_signal[0]));
+    return 1;
+#elif defined(DTHREAD_HAVE_EVENTFD)
+    {
+	uint64_t one = 1;
+	DEBUGF("dthread_signal_set: efd=%d", DTHREAD_EVENT(thr->iq_signal[0]));
+	return write(DTHREAD_EVENT(thr->iq_signal[0]), &one, sizeof(one));
+    }
+#else
+    DEBUGF("dthread_signal_set: fd=%d", DTHREAD_EVENT(thr->iq_signal[1]));
+    return write(DTHREAD_EVENT(thr->iq_signal[1]), "!", 1);
+#endif
+}
+
+// consume wakeup token(s)
+// In lock-free mode the signal may be set more than once per empty to
+// non-empty transition, so drain the pipe (it is non blocking)
+// an eventfd counter is cleared by a single read
+int dthread_signal_reset(dthread_t* thr)
+{
+#ifdef __WIN32__
+    DEBUGF("dthread_signal_reset: handle=%d", DTHREAD_EVENT(thr->iq_signal[0]));
+    ResetEvent(DTHREAD_EVENT(thr->iq_signal[0]));
+    return 0;
+#elif defined(DTHREAD_HAVE_EVENTFD)
+    {
+	uint64_t count;
+	DEBUGF("dthread_signal_reset: efd=%d", DTHREAD_EVENT(thr->iq_signal[0]));
+	if (read(DTHREAD_EVENT(thr->iq_signal[0]), &count, sizeof(count)) < 0)
+	    return 0;
+	return (int) count;
+    }
+#else
+    {
+	char buf[64];
+	int n, r = 0;
+	DEBUGF("dthread_signal_reset: fd=%d", DTHREAD_EVENT(thr->iq_signal[0]));
+	while((n = read(DTHREAD_EVENT(thr->iq_signal[0]), buf, sizeof(buf))) > 0)
+	    r += n;
+	return r;
+    }
+#endif
+}
+
+void dthread_signal_finish(dthread_t* thr, int and_close)
+{
+    if (thr->iq_signal[0] != (ErlDrvEvent)DTHREAD_INVALID_EVENT) {
+	if (and_close) {
+	    DEBUGF("dthread_signal_finish: close iq_signal[0]=%d",
+		   DTHREAD_EVENT(thr->iq_signal[0]));
+	    DTHREAD_CLOSE_EVENT(thr->iq_signal[0]);
+	}
+	thr->iq_signal[0] = (ErlDrvEvent)DTHREAD_INVALID_EVENT;
+    }
+
+    if (thr->iq_signal[1] != (ErlDrvEvent)DTHREAD_INVALID_EVENT) {
+	if (and_close) {
+	    DEBUGF("dthread_signal_finish: iq_signal[1]=%d",
+		   DTHREAD_EVENT(thr->iq_signal[1]));
+	    DTHREAD_CLOSE_EVENT(thr->iq_signal[1]);
+	}
+	thr->iq_signal[1] = (ErlDrvEvent)DTHREAD_INVALID_EVENT;
+    }
+}
+
+
+// Cleanup the mess
+void dthread_finish(dthread_t* thr)
+{
+    dmessage_t* mp;
+    int q;
+
+    if (thr->iq_mtx) {
+	erl_drv_mutex_destroy(thr->iq_mtx);
+	thr->iq_mtx = NULL;
+    }
+    dthread_reactor_finish(thr);
+    dthread_io_finish(thr);
+    dthread_reply_finish(thr);
+    dthread_chan_finish(thr);
+    dthread_timer_finish(thr);
+    for (q = 0; q < DTHREAD_NUM_PRIO; q++) {
+	mp = thr->iq_front[q];
+	while(mp) {
+	    dmessage_t* tmp = mp->next;
+	    if (mp != &thr->iq_stub[q])
+		dmessage_free(mp);
+	    mp = tmp;
+	}
+	thr->iq_front[q] = thr->iq_rear[q] = NULL;
+    }
+    thr->iq_len = 0;
+    thr->iq_bytes = 0;
+    thr->iq_busy = 0;
+    dthread_signal_finish(thr, 0);
+}
+
+// Initialize thread structure
+int dthread_init(dthread_t* thr, ErlDrvPort port)
+{
+    ErlDrvSysInfo sys_info;
+
+    memset(thr, 0, sizeof(dthread_t));
+    dthread_signal_init(thr);
+    driver_system_info(&sys_info, sizeof(ErlDrvSysInfo));
+    // smp_support is used for message passing from thread to
+    // calling process. if SMP is supported the message will go
+    // directly to sender, otherwise it must be sent to port 
+    thr->smp_support = sys_info.smp_support;
+    thr->port = port;
+    thr->dport = driver_mk_port(port);
+    thr->owner = driver_connected(port);
+    // until the consumer use dthread_poll it must be signaled
+    thr->iq_sleeping = 1;
+
+    if (!(thr->iq_mtx = erl_drv_mutex_create("iq_mtx")))
+	return -1;
+#ifdef DTHREAD_HAVE_LOCKFREE
+    dthread_queue_mode(thr, DTHREAD_QUEUE_LOCKFREE);
+#else
+    dthread_queue_mode(thr, DTHREAD_QUEUE_MUTEX);
+#endif
+#ifdef __WIN32__
+    // create a manual reset event
+    if (!(thr->iq_signal[0] = (ErlDrvEvent)
+	  CreateEvent(NULL, TRUE, FALSE, NULL))) {
+	dthread_finish(thr);
+	return -1;
+    }
+    DEBUGF("dthread_init: handle=%d", DTHREAD_EVENT(thr->iq_signal[0]));
+#elif defined(DTHREAD_HAVE_EVENTFD)
+    {
+	int efd;
+	// one counting event fd, read and written in non blocking mode
+	if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+	    dthread_finish(thr);
+	    return -1;
+	}
+	thr->iq_signal[0] = (ErlDrvEvent) ((long)efd);
+	INFOF("eventfd: %d", efd);
+    }
+#else
+    {
+	int pfd[2];
+	if (pipe(pfd) < 0) {
+	    dthread_finish(thr);
+	    return -1;
+	}
+	// reset drains the pipe and may race with set in lock-free mode
+	fcntl(pfd[0], F_SETFL, fcntl(pfd[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(pfd[1], F_SETFL, fcntl(pfd[1], F_GETFL, 0) | O_NONBLOCK);
+	DEBUGF("dthread_init: pipe[0]=%d,pidp[1]=%d", pfd[0], pfd[1]);
+	thr->iq_signal[0] = (ErlDrvEvent) ((long)pfd[0]);
+	thr->iq_signal[1] = (ErlDrvEvent) ((long)pfd[1]);
+	INFOF("pipe: %d,%d", pfd[0], pfd[1]);
+    }
+#endif
+    return 0;
+}
+
+static int dthread_create(dthread_t* thr, void* (*func)(void* arg),
+			  void* arg, int stack_size)
+{
+    ErlDrvThreadOpts* opts;
+    int r;
+
+    if (!(opts = erl_drv_thread_opts_create("dthread_opts")))
+	return -1;
+    opts->suggested_stack_size = stack_size;
+    thr->arg = arg;
+    r = erl_drv_thread_create("dthread", &thr->tid, func, thr, opts);
+    erl_drv_thread_opts_destroy(opts);
+    return (r == 0) ? 0 : -1;
+}
+
+dthread_t* dthread_start(ErlDrvPort port,
+			 void* (*func)(void* arg),
+			 void* arg, int stack_size)
+{
+    dthread_t* thr = NULL;
+
+    if (!(thr = DALLOC(sizeof(dthread_t))))
+	return 0;
+
+    if (dthread_init(thr, port) < 0)
+	goto error;
+
+    if (dthread_create(thr, func, arg, stack_size) < 0)
+	goto error;
+    return thr;
+
+error:
+    dthread_finish(thr);
+    DFREE(thr);
+    return 0;
+}
+
+int dthread_stop(dthread_t* target, dthread_t* source, 
+		 void** exit_value)
+{
+    dmessage_t* mp;
+    int r;
+
+    if (!(mp = dmessage_create(DTHREAD_STOP, NULL, 0)))
+	return -1;
+    dthread_send(target, source, mp);
+
+    DEBUGF("dthread_stop: wait to join");
+    r = erl_drv_thread_join(target->tid, exit_value);
+    DEBUGF("dthread_stop: thread_join: return=%d, exit_value=%p", r, *exit_value);
+
+    dthread_signal_finish(target, 1);
+    dthread_finish(target);
+    DFREE(target);
+    return 0;
+}
+
+void dthread_exit(void* value)
+{
+    dmessage_cache_release();
+    erl_drv_thread_exit(value);
+}
+
+// Set the adaptive spin limit used by dthread_poll before it blocks,
+// 0 (default) disables spinning. Only used in lock-free mode.
+void dthread_poll_spin(dthread_t* thr, int spin)
+{
+    thr->iq_spin_max = (spin < 0) ? 0 : spin;
+    thr->iq_spin = thr->iq_spin_max;
+}
+
+#ifdef DTHREAD_HAVE_LOCKFREE
+// Spin/yield for a while waiting for a message. The limit is doubled
+// back to max when a message arrive while spinning and halved (down
+// to max/8) when we end up blocking anyway.
+static int iq_spin(dthread_t* thr)
+{
+    int n = thr->iq_spin;
+    int i, len = 0;
+
+    for (i = 0; i < n; i++) {
+	if ((len = __atomic_load_n(&thr->iq_len, __ATOMIC_ACQUIRE)) > 0)
+	    break;
+	if ((i % DTHREAD_SPIN_YIELD) == (DTHREAD_SPIN_YIELD-1))
+	    DTHREAD_YIELD();
+	else
+	    DTHREAD_CPU_RELAX();
+    }
+    if (len > 0) {
+	if ((n *= 2) > thr->iq_spin_max) n = thr->iq_spin_max;
+    }
+    else {
+	if ((n /= 2) < thr->iq_spin_max/8) n = thr->iq_spin_max/8;
+    }
+    thr->iq_spin = n;
+    return len;
+}
+#endif
+
+// Consumer is about to block in dthread_poll, tell producers to signal.
+// return the queue length, if > 0 the consumer must not block
+static int iq_sleep(dthread_t* thr, int timeout)
+{
+    int len;
+#ifdef DTHREAD_HAVE_LOCKFREE
+    if (thr->iq_mode == DTHREAD_QUEUE_LOCKFREE) {
+	if ((timeout != 0) && (thr->iq_spin > 0) && ((len = iq_spin(thr)) > 0))
+	    return len;
+	// pairs with iq_len increment / iq_sleeping load in dthread_send
+	__atomic_store_n(&thr->iq_sleeping, 1, __ATOMIC_SEQ_CST);
+	if ((len = __atomic_load_n(&thr->iq_len, __ATOMIC_SEQ_CST)) > 0)
+	    __atomic_store_n(&thr->iq_sleeping, 0, __ATOMIC_SEQ_CST);
+	return len;
+    }
+#else
+    (void) timeout;
+#endif
+    erl_drv_mutex_lock(thr->iq_mtx);
+    if ((len = thr->iq_len) == 0)
+	thr->iq_sleeping = 1;
+    erl_drv_mutex_unlock(thr->iq_mtx);
+    return len;
+}
+
+// Consumer returned from wait, producers need not signal until next
+// iq_sleep. Consume wakeup tokens if signaled and return queue length.
+static int iq_wakeup(dthread_t* thr, int signaled)
+{
+    int len;
+#ifdef DTHREAD_HAVE_LOCKFREE
+    if (thr->iq_mode == DTHREAD_QUEUE_LOCKFREE) {
+	__atomic_store_n(&thr->iq_sleeping, 0, __ATOMIC_SEQ_CST);
+	if (signaled)
+	    dthread_signal_reset(thr);
+	return __atomic_load_n(&thr->iq_len, __ATOMIC_SEQ_CST);
+    }
+#endif
+    erl_drv_mutex_lock(thr->iq_mtx);
+    thr->iq_sleeping = 0;
+    if (signaled)
+	dthread_signal_reset(thr);
+    len = thr->iq_len;
+    erl_drv_mutex_unlock(thr->iq_mtx);
+    return len;
+}
+
+//
+// Wait for the dthread queue and the events, see dthread_poll below,
+// timeout in microseconds
+//
+#ifdef __WIN32__
+
+static int poll_wait(dthread_t* thr, dthread_poll_event_t* events,
+		     size_t* nevents, ErlDrvTime timeout)
+{
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+    int    eindex[MAXIMUM_WAIT_OBJECTS];
+    DWORD  nCount = 0;
+    DWORD  iq_len = 0;
+    DWORD  nready = 0;
+    DWORD  dwMilliseconds;
+    DWORD  res;
+    int    signaled = 0;
+    int    i,n;
+
+    if ((iq_len = iq_sleep(thr, timeout != 0)) > 0) {
+	if (!events || !nevents || !*nevents)
+	    return iq_len;
+	timeout = 0;  // messages are waiting, just check the events
+    }
+
+    if (timeout < 0)
+	dwMilliseconds = INFINITE;
+    else
+	dwMilliseconds = (DWORD) ((timeout + 999) / 1000);
+
+    // install handles to wait for
+    if (DTHREAD_EVENT(thr->iq_signal[0]) != DTHREAD_INVALID_EVENT) {
+	eindex[nCount] = -1;  // -1 == signal queue event
+	handles[nCount] = DTHREAD_EVENT(thr->iq_signal[0]);
+	nCount++;
+    }
+
+    if (events && nevents && *nevents) {
+	n = (DWORD) (*nevents);
+	for (i = 0; (nCount < MAXIMUM_WAIT_OBJECTS) && (i < n); i++) {
+	    events[i].revents = 0; // clear here in case of timeout etc
+	    if (events[i].events) {
+		eindex[nCount]  = i;  // index in event array
+		handles[nCount] = DTHREAD_EVENT(events[i].event);
+		nCount++;
+	    }
+	}
+    }
+
+    DEBUGF("WaitForMultipleObjects nCount=%d, timeout=%d", nCount, 
+	   dwMilliseconds);
+    // wait for first event that is signaled
+    res = WaitForMultipleObjects(nCount, handles, FALSE, dwMilliseconds);
+    DEBUGF("WaitForMultipleObjects result=%d", res);
+    
+    if ((res == WAIT_TIMEOUT) || (res == WAIT_FAILED)) {
+	iq_len = iq_wakeup(thr, 0);
+	if (nevents)
+	    *nevents = 0;
+	return (res == WAIT_FAILED) ? -1 : (int) iq_len;
+    }
+    else if ((res >= WAIT_OBJECT_0) && (res < (WAIT_OBJECT_0+nCount))) {
+	DWORD j = res - WAIT_OBJECT_0;
+	
+	if ((i = eindex[j]) < 0)
+	    signaled = 1;
+	else if (events != NULL) {
+	    events[i].revents |= ERL_DRV_READ;  // event is ready
+	    nready++;
+	}
+	j++;
+
+	// must scan rest of the events as well, else starvation may occure 
+	while (j < nCount) {
+	    if (WaitForSingleObject(handles[j], 0) == WAIT_OBJECT_0) {
+		if ((i = eindex[j]) < 0)
+		    signaled = 1;
+		else if (events != NULL) {
+		    events[i].revents |= ERL_DRV_READ;  // event is ready
+		    nready++;
+		}		
+	    }
+	    j++;
+	}
+    }
+    iq_len = iq_wakeup(thr, signaled);
+    if (nevents)
+	*nevents = nready;
+    return iq_len;
+}
+#else
+
+static int poll_wait(dthread_t* thr, dthread_poll_event_t* events,
+		     size_t* nevents, ErlDrvTime timeout)
+{
+    struct timeval tm;
+    struct timeval* tp;
+    fd_set readfds;
+    fd_set writefds;
+    fd_set errorfds;
+    int fd,nfds = 0;
+    int ready;
+    int signaled = 0;
+    int i,n,iq_len=0;
+
+    if ((iq_len = iq_sleep(thr, timeout != 0)) > 0) {
+	if (!events || !nevents || !*nevents)
+	    return iq_len;
+	timeout = 0;  // messages are waiting, just check the events
+    }
+
+    if (timeout < 0)
+	tp = NULL;
+    else {
+	tm.tv_sec = timeout / 1000000;
+	tm.tv_usec = timeout % 1000000;
+	tp = &tm;
+    }
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    FD_ZERO(&errorfds);
+
+    if ((fd = DTHREAD_EVENT(thr->iq_signal[0])) >= 0) {
+	FD_SET(fd, &readfds);
+	FD_SET(fd, &errorfds);
+	DEBUGF("FD_SET: iq_signal[0] = %d", fd);
+	if (fd > nfds) nfds = fd;
+    }
+
+    if (events && nevents && *nevents) {
+	n = (int) (*nevents);
+	for (i = 0; i < n; i++) {
+	    events[i].revents = 0;  // clear here in case of timeout etc
+	    if (events[i].events) {
+		fd = DTHREAD_EVENT(events[i].event);
+		if ((fd < 0) || (fd >= FD_SETSIZE)) {
+		    // select can not handle it, use the reactor
+		    iq_wakeup(thr, 0);
+		    *nevents = 0;
+		    errno = EINVAL;
+		    return -1;
+		}
+		if (events[i].events & ERL_DRV_READ) {
+		    FD_SET(fd, &readfds);
+		    FD_SET(fd, &errorfds);
+		}
+		if (events[i].events & ERL_DRV_WRITE)
+		    FD_SET(fd, &writefds);
+		if (fd > nfds) nfds = fd;
+	    }
+	}
+    }
+
+    DEBUGF("select nfds=%d, tp=%p", nfds, tp);
+    ready = select(nfds+1, &readfds, &writefds, &errorfds, tp);
+    DEBUGF("select result r=%d", ready);
+
+    // check queue !
+    fd = DTHREAD_EVENT(thr->iq_signal[0]);
+    if ((ready > 0) && (fd >= 0) && FD_ISSET(fd, &readfds)) {
+	signaled = 1;
+	ready--;
+    }
+    iq_len = iq_wakeup(thr, signaled);
+
+    if (ready <= 0) {
+	if (nevents)
+	    *nevents = 0;
+	return (ready < 0) ? ready : iq_len;
+    }
+
+    // check io events, ready counts set memberships not descriptors
+    // (and the same fd may be listed twice) so scan them all
+    if (events && nevents && *nevents) {
+	size_t nready = 0;
+	n = (int) (*nevents);
+	for (i = 0; i < n; i++) {
+	    if (!events[i].events)
+		continue;
+	    fd = DTHREAD_EVENT(events[i].event);
+	    if ((events[i].events & ERL_DRV_READ) &&
+		(FD_ISSET(fd, &readfds) || FD_ISSET(fd, &errorfds))) {
+		events[i].revents |= ERL_DRV_READ;
+		if (FD_ISSET(fd, &errorfds))
+		    events[i].revents |= ERL_DRV_EXCEP;
+	    }
+	    if ((events[i].events & ERL_DRV_WRITE) && FD_ISSET(fd, &writefds))
+		events[i].revents |= ERL_DRV_WRITE; 
+	    if (events[i].revents)
+		nready++;
+	}
+	*nevents = nready;
+    }
+    return iq_len;
+}
+#endif
+
+//
+// Poll dthread queue and optionally other INPUT! events given by events
+// number of input events are given in *nevents and number of ready
+// events are also outputed there. Expired timers are run from here,
+// the wait is cut short at the next timer expiry and returns (0 if
+// nothing else happened) after timers have expired.
+//
+// return -1  on error
+//         0  timeout | no messages in queue (maybe in in nevents)
+//         n  number of messages ready to be read (0 also means timeout!)
+//
+int dthread_poll(dthread_t* thr, dthread_poll_event_t* events, size_t* nevents, 
+		 int timeout)
+{
+    size_t n = nevents ? *nevents : 0;
+    ErlDrvTime deadline = -1;
+    ErlDrvTime now, tmo;
+    int r;
+
+    if (!thr->timers)
+	return poll_wait(thr, events, nevents,
+			 (timeout < 0) ? -1 : (ErlDrvTime) timeout*1000);
+
+    now = erl_drv_monotonic_time(ERL_DRV_USEC);
+    if (timeout >= 0)
+	deadline = now + (ErlDrvTime) timeout*1000;
+    while(1) {
+	tmo = tw_next_usec(thr->timers, now);
+	if ((deadline >= 0) && ((tmo < 0) || (deadline - now < tmo)))
+	    tmo = (deadline > now) ? (deadline - now) : 0;
+	if (nevents)
+	    *nevents = n;
+	r = poll_wait(thr, events, nevents, tmo);
+	if ((dthread_timer_expire(thr) > 0) || (r != 0) ||
+	    (nevents && *nevents))
+	    return r;
+	now = erl_drv_monotonic_time(ERL_DRV_USEC);
+	if ((deadline >= 0) && (now >= deadline))
+	    return 0;
+    }
+}
+
+
+/******************************************************************************
+ *
+ *   Thread pool
+ *
+ *****************************************************************************/
+
+// Stop the first n workers: all are told to stop before any is freed
+// since running workers may look at the others when stealing.
+static void pool_stop_workers(dthread_pool_t* pool, dthread_t* source, int n)
+{
+    void* value;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	dmessage_t* mp;
+	if ((mp = dmessage_create(DTHREAD_STOP, NULL, 0)))
+	    dthread_send(pool->thr[i], source, mp);
+    }
+    for (i = 0; i < n; i++)
+	erl_drv_thread_join(pool->thr[i]->tid, &value);
+    for (i = 0; i < n; i++) {
+	dthread_signal_finish(pool->thr[i], 1);
+	dthread_finish(pool->thr[i]);
+	DFREE(pool->thr[i]);
+    }
+}
+
+//
+// Start a pool of n workers. Each worker runs func like a thread
+// from dthread_start, with self->arg = arg and self->pool = pool,
+// and should receive with dthread_pool_recv. Stealing needs the
+// locked queue, so the lock-free queue is only used for a single
+// worker.
+//
+dthread_pool_t* dthread_pool_start(ErlDrvPort port, int n,
+				   void* (*func)(void* arg),
+				   void* arg, int stack_size)
+{
+    dthread_pool_t* pool;
+    int i, started;
+
+    if ((n <= 0) || !(pool = DZALLOC(sizeof(dthread_pool_t))))
+	return NULL;
+    if (!(pool->thr = DZALLOC(n*sizeof(dthread_t*))))
+	goto error;
+
+    for (pool->n = 0; pool->n < n; pool->n++) {
+	dthread_t* thr;
+	if (!(thr = DALLOC(sizeof(dthread_t))))
+	    goto error;
+	if (dthread_init(thr, port) < 0) {
+	    dthread_finish(thr);
+	    DFREE(thr);
+	    goto error;
+	}
+	if (n > 1)
+	    dthread_queue_mode(thr, DTHREAD_QUEUE_MUTEX);
+	thr->pool = pool;
+	pool->thr[pool->n] = thr;
+    }
+
+    for (started = 0; started < n; started++) {
+	if (dthread_create(pool->thr[started], func, arg, stack_size) < 0)
+	    break;
+    }
+    if (started == n)
+	return pool;
+
+    pool_stop_workers(pool, NULL, started);
+    for (i = started; i < n; i++) {
+	dthread_finish(pool->thr[i]);
+	DFREE(pool->thr[i]);
+    }
+    pool->n = 0;
+error:
+    for (i = 0; i < pool->n; i++) {
+	dthread_finish(pool->thr[i]);
+	DFREE(pool->thr[i]);
+    }
+    if (pool->thr)
+	DFREE(pool->thr);
+    DFREE(pool);
+    return NULL;
+}
+
+int dthread_pool_stop(dthread_pool_t* pool, dthread_t* source)
+{
+    pool_stop_workers(pool, source, pool->n);
+    DFREE(pool->thr);
+    DFREE(pool);
+    return 0;
+}
+
+// FNV-1a hash of a routing key
+unsigned int dthread_key_hash(const char* buf, size_t len)
+{
+    uint32_t h = 2166136261U;
+
+    while(len--) {
+	h ^= (uint8_t) *buf++;
+	h *= 16777619U;
+    }
+    return h;
+}
+
+// Find the routing key of a message when the pool route on the
+// leading keylen bytes of the data. Messages with less data are
+// not keyed.
+static int pool_message_key(dthread_pool_t* pool, dmessage_t* mp)
+{
+    char* ptr = mp->buffer;
+    size_t len = mp->used;
+
+    if (mp->flags & DMESSAGE_KEYED)
+	return 1;
+    if ((pool->keylen <= 0) || (mp->cmd == DTHREAD_STOP))
+	return 0;
+    if (!ptr && (mp->iovcnt > 0)) {  // segmented outputv data
+	// hash the first keylen bytes across the segments (FNV-1a is
+	// incremental, same value as dthread_key_hash on flat data)
+	uint32_t h = 2166136261U;
+	size_t need = pool->keylen;
+	int i;
+
+	for (i = 0; (i < mp->iovcnt) && (need > 0); i++) {
+	    uint8_t* p = (uint8_t*) mp->iov[i].iov_base;
+	    size_t n = mp->iov[i].iov_len;
+	    if (n > need)
+		n = need;
+	    need -= n;
+	    while(n--) {
+		h ^= *p++;
+		h *= 16777619U;
+	    }
+	}
+	if (need > 0)
+	    return 0;
+	mp->key = h;
+	mp->flags |= DMESSAGE_KEYED;
+	return 1;
+    }
+    if (!ptr || (len < (size_t) pool->keylen))
+	return 0;
+    mp->key = dthread_key_hash(ptr, pool->keylen);
+    mp->flags |= DMESSAGE_KEYED;
+    return 1;
+}
+
+//
+// Send to the worker owning key. Keyed messages are not stolen, so
+// all messages with the same key are handled in order by one worker
+// while different keys may run in parallel.
+//
+int dthread_pool_send_key(dthread_pool_t* pool, dthread_t* source,
+			  dmessage_t* mp, unsigned int key)
+{
+    uint32_t h = key * 2654435761U;  // spread sequential keys
+    int i = (int) (((uint64_t) h * pool->n) >> 32);
+
+    mp->key = key;
+    mp->flags |= DMESSAGE_KEYED;
+    return dthread_send(pool->thr[i], source, mp);
+}
+
+// Queue state of other workers is only a hint, read it without lock
+#if defined(__ATOMIC_RELAXED)
+#define POOL_HINT(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#else
+#define POOL_HINT(x) (x)
+#endif
+
+// queue length (behind the running command) where a sleeping worker
+// is woken to steal
+#define POOL_WAKE_LEN 1
+
+// Wake one sleeping idle worker, it steals when it finds its own
+// queue empty (dthread_pool_recv)
+static void pool_wake_idle(dthread_pool_t* pool, dthread_t* busy)
+{
+    int i;
+
+    for (i = 0; i < pool->n; i++) {
+	dthread_t* thr = pool->thr[i];
+	if ((thr != busy) && POOL_HINT(thr->iq_sleeping) &&
+	    (POOL_HINT(thr->iq_len) == 0)) {
+	    dthread_signal_set(thr);
+	    return;
+	}
+    }
+}
+
+//
+// Send to an idle worker if any (searched round robin), otherwise
+// to the worker with the shortest queue. When that queue has a
+// backlog a sleeping worker is woken to steal from it. Keyed
+// messages (see keylen) go to the worker owning the key.
+//
+int dthread_pool_send(dthread_pool_t* pool, dthread_t* source,
+		      dmessage_t* mp)
+{
+    int i, r, best = pool->next;
+    int best_len = -1;
+
+    if (pool_message_key(pool, mp))
+	return dthread_pool_send_key(pool, source, mp, mp->key);
+    if (pool->n > 1) {
+	for (i = 0; i < pool->n; i++) {
+	    int j = (pool->next + i) % pool->n;
+	    dthread_t* thr = pool->thr[j];
+	    int len = POOL_HINT(thr->iq_len);
+
+	    if ((len == 0) && POOL_HINT(thr->iq_sleeping)) {
+		best = j;
+		best_len = -1;
+		break;
+	    }
+	    if ((best_len < 0) || (len < best_len)) {
+		best = j;
+		best_len = len;
+	    }
+	}
+	pool->next = (best + 1) % pool->n;
+    }
+    r = dthread_send(pool->thr[best], source, mp);
+    if ((r >= 0) && (best_len >= POOL_WAKE_LEN))
+	pool_wake_idle(pool, pool->thr[best]);
+    return r;
+}
+
+// Steal the front message of the highest lane possible from a worker
+// queue. Stop messages and keyed messages are never stolen, they
+// belong to the worker.
+static dmessage_t* pool_steal(dthread_t* thr)
+{
+    dmessage_t* mp = NULL;
+    int q, low = 0;
+
+    erl_drv_mutex_lock(thr->iq_mtx);
+    for (q = 0; !mp && (q < DTHREAD_NUM_PRIO); q++) {
+	dmessage_t* front = thr->iq_front[q];
+	if (front && (front->cmd != DTHREAD_STOP) &&
+	    !(front->flags & DMESSAGE_KEYED))
+	    mp = mq_pop_lane(thr, q, &low);
+    }
+    erl_drv_mutex_unlock(thr->iq_mtx);
+    if (low)
+	iq_notify_low(thr, mp->source);
+    return mp;
+}
+
+//
+// Receive from own queue, when empty steal from the worker with
+// the longest queue. Workers should call this before dthread_poll
+// so that an idle worker picks up work queued behind a busy one.
+//
+dmessage_t* dthread_pool_recv(dthread_t* self, dthread_t** source)
+{
+    dthread_pool_t* pool = self->pool;
+    dthread_t* victim = NULL;
+    dmessage_t* mp;
+    int i, max_len = 0;
+
+    if ((mp = dthread_recv(self, source)) || !pool || (pool->n < 2))
+	return mp;
+
+    for (i = 0; i < pool->n; i++) {
+	dthread_t* thr = pool->thr[i];
+	int len = POOL_HINT(thr->iq_len);
+	if ((thr != self) && (len > max_len)) {
+	    victim = thr;
+	    max_len = len;
+	}
+    }
+    if (victim && (mp = pool_steal(victim))) {
+	DEBUGF("dthread_pool_recv: stole cmd=%d", mp->cmd);
+	if (source)
+	    *source = mp->source;
+    }
+    return mp;
+}
+
+// Cancel a request queued on any worker (it may have been stolen)
+int dthread_pool_cancel(dthread_pool_t* pool, dthread_t* source,
+			ErlDrvTermData ref, ErlDrvTermData caller)
+{
+    int i, r, n = 0;
+
+    for (i = 0; (i < pool->n) && (n == 0); i++) {
+	if ((r = dthread_cancel(pool->thr[i], source, ref, caller)) < 0)
+	    return -1;
+	n += r;
+    }
+    return n;
+}
+
+int dthread_pool_purge(dthread_pool_t* pool, dthread_t* source,
+		       ErlDrvTermData pid)
+{
+    int i, r, n = 0;
+
+    for (i = 0; i < pool->n; i++) {
+	if ((r = dthread_purge(pool->thr[i], source, pid)) < 0)
+	    return -1;
+	n += r;
+    }
+    return n;
+}
+
+// Any worker queue busy
+int dthread_pool_busy(dthread_pool_t* pool)
+{
+    int i;
+
+    for (i = 0; i < pool->n; i++) {
+	if (dthread_queue_busy(pool->thr[i]))
+	    return 1;
+    }
+    return 0;
+}
+
+/******************************************************************************
+ *
+ *   Reactor
+ *
+ *  Events are registered once with a handler and dthread_reactor_wait
+ *  calls the handlers of ready events. Linux use epoll (level triggered,
+ *  the queue signal is registered as well), elsewhere the registered
+ *  events are passed to dthread_poll. Only the consumer thread may use
+ *  the reactor of a dthread, handlers may add/mod/del events.
+ *
+ *****************************************************************************/
+
+#define DTHREAD_REACTOR_MAX_EVENTS 64
+
+typedef struct _dthread_reactor_entry_t {
+    dthread_poll_event_t pev;   // event, events, revents
+    dthread_handler_t handler;
+    void* arg;
+    int   dead;                 // deleted while dispatching
+} dthread_reactor_entry_t;
+
+typedef struct _dthread_reactor_t {
+#ifdef DTHREAD_HAVE_EPOLL
+    int epfd;                   // epoll instance
+#else
+    dthread_poll_event_t* pev;  // dthread_poll argument (size entries)
+    struct _dthread_reactor_entry_t** ready; // entries polled (size entries)
+#endif
+    int dispatching;            // in handler loop, delay free
+    size_t n;                   // number of entries in use
+    size_t size;                // allocated entries
+    dthread_reactor_entry_t** entry;
+    dthread_reactor_entry_t* dead;  // freed after dispatch (chained in arg)
+} dthread_reactor_t;
+
+#ifdef DTHREAD_HAVE_EPOLL
+static uint32_t reactor_epoll_events(int events)
+{
+    uint32_t ev = 0;
+    if (events & ERL_DRV_READ)  ev |= EPOLLIN;
+    if (events & ERL_DRV_WRITE) ev |= EPOLLOUT;
+    return ev;
+}
+#endif
+
+static dthread_reactor_t* reactor_get(dthread_t* thr)
+{
+    dthread_reactor_t* r;
+
+    if ((r = thr->reactor) != NULL)
+	return r;
+    if ((r = DZALLOC(sizeof(dthread_reactor_t))) == NULL)
+	return NULL;
+#ifdef DTHREAD_HAVE_EPOLL
+    if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	DFREE(r);
+	return NULL;
+    }
+    if (thr->iq_signal[0] != (ErlDrvEvent)DTHREAD_INVALID_EVENT) {
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;  // NULL = queue signal
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD,
+		      DTHREAD_EVENT(thr->iq_signal[0]), &ev) < 0) {
+	    close(r->epfd);
+	    DFREE(r);
+	    return NULL;
+	}
+    }
+    DEBUGF("dthread_reactor: epfd=%d", r->epfd);
+#endif
+    thr->reactor = r;
+    return r;
+}
+
+static int reactor_find(dthread_reactor_t* r, ErlDrvEvent event)
+{
+    size_t i;
+    for (i = 0; i < r->n; i++) {
+	if (r->entry[i]->pev.event == event)
+	    return (int) i;
+    }
+    return -1;
+}
+
+static void reactor_release(dthread_reactor_t* r)
+{
+    while(r->dead) {
+	dthread_reactor_entry_t* ep = r->dead;
+	r->dead = (dthread_reactor_entry_t*) ep->arg;
+	DFREE(ep);
+    }
+}
+
+void dthread_reactor_finish(dthread_t* thr)
+{
+    dthread_reactor_t* r;
+    size_t i;
+
+    if ((r = thr->reactor) == NULL)
+	return;
+#ifdef DTHREAD_HAVE_EPOLL
+    close(r->epfd);
+#else
+    DFREE(r->pev);
+    DFREE(r->ready);
+#endif
+    for (i = 0; i < r->n; i++)
+	DFREE(r->entry[i]);
+    DFREE(r->entry);
+    reactor_release(r);
+    DFREE(r);
+    thr->reactor = NULL;
+}
+
+// register event, with handler called when event is ready
+int dthread_reactor_add(dthread_t* thr, ErlDrvEvent event, int events,
+			dthread_handler_t handler, void* arg)
+{
+    dthread_reactor_t* r;
+    dthread_reactor_entry_t* ep;
+
+    if ((r = reactor_get(thr)) == NULL)
+	return -1;
+    if (reactor_find(r, event) >= 0)
+	return -1;
+    if (r->n == r->size) {
+	size_t size = r->size ? 2*r->size : 16;
+	dthread_reactor_entry_t** entry;
+	if ((entry = DREALLOC(r->entry, size*sizeof(*entry))) == NULL)
+	    return -1;
+	r->entry = entry;
+#ifndef DTHREAD_HAVE_EPOLL
+	{
+	    dthread_poll_event_t* pev;
+	    dthread_reactor_entry_t** ready;
+	    if ((pev = DREALLOC(r->pev, size*sizeof(*pev))) == NULL)
+		return -1;
+	    r->pev = pev;
+	    if ((ready = DREALLOC(r->ready, size*sizeof(*ready))) == NULL)
+		return -1;
+	    r->ready = ready;
+	}
+#endif
+	r->size = size;
+    }
+    if ((ep = DZALLOC(sizeof(dthread_reactor_entry_t))) == NULL)
+	return -1;
+    ep->pev.event = event;
+    ep->pev.events = events;
+    ep->handler = handler;
+    ep->arg = arg;
+#ifdef DTHREAD_HAVE_EPOLL
+    {
+	struct epoll_event ev;
+	ev.events = reactor_epoll_events(events);
+	ev.data.ptr = ep;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, DTHREAD_EVENT(event), &ev) < 0) {
+	    DFREE(ep);
+	    return -1;
+	}
+    }
+#endif
+    r->entry[r->n++] = ep;
+    return 0;
+}
+
+// change the events (ERL_DRV_READ|ERL_DRV_WRITE) waited for
+int dthread_reactor_mod(dthread_t* thr, ErlDrvEvent event, int events)
+{
+    dthread_reactor_t* r;
+    int i;
+
+    if (((r = thr->reactor) == NULL) || ((i = reactor_find(r, event)) < 0))
+	return -1;
+#ifdef DTHREAD_HAVE_EPOLL
+    {
+	struct epoll_event ev;
+	ev.events = reactor_epoll_events(events);
+	ev.data.ptr = r->entry[i];
+	if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, DTHREAD_EVENT(event), &ev) < 0)
+	    return -1;
+    }
+#endif
+    r->entry[i]->pev.events = events;
+    return 0;
+}
+
+// unregister event, must be done before the event is closed
+int dthread_reactor_del(dthread_t* thr, ErlDrvEvent event)
+{
+    dthread_reactor_t* r;
+    dthread_reactor_entry_t* ep;
+    int i;
+
+    if (((r = thr->reactor) == NULL) || ((i = reactor_find(r, event)) < 0))
+	return -1;
+    ep = r->entry[i];
+#ifdef DTHREAD_HAVE_EPOLL
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, DTHREAD_EVENT(event), NULL);
+#endif
+    r->entry[i] = r->entry[--r->n];
+    if (r->dispatching) {
+	// may still be referenced from the ready list
+	ep->dead = 1;
+	ep->arg = (void*) r->dead;
+	r->dead = ep;
+    }
+    else
+	DFREE(ep);
+    return 0;
+}
+
+//
+// Wait for queue or registered events and call the handlers for
+// the ready events.
+// return -1  on error
+//         n  number of messages in queue (0 also means timeout!)
+//
+#ifdef DTHREAD_HAVE_EPOLL
+int dthread_reactor_wait(dthread_t* thr, int timeout)
+{
+    struct epoll_event evs[DTHREAD_REACTOR_MAX_EVENTS];
+    dthread_reactor_t* r;
+    int signaled = 0;
+    int i, n, iq_len;
+
+    if ((r = reactor_get(thr)) == NULL)
+	return -1;
+    timeout = tw_wait_timeout(thr, timeout);
+    if ((iq_len = iq_sleep(thr, timeout)) > 0) {
+	if (r->n == 0) {
+	    dthread_timer_expire(thr);
+	    return iq_len;
+	}
+	timeout = 0;  // messages are waiting, just check the events
+    }
+    n = epoll_wait(r->epfd, evs, DTHREAD_REACTOR_MAX_EVENTS, timeout);
+    DEBUGF("dthread_reactor_wait: epoll_wait=%d", n);
+    for (i = 0; i < n; i++) {
+	if (evs[i].data.ptr == NULL)
+	    signaled = 1;
+    }
+    iq_len = iq_wakeup(thr, signaled);
+    dthread_timer_expire(thr);
+    if (n < 0)
+	return (errno == EINTR) ? iq_len : -1;
+
+    r->dispatching = 1;
+    for (i = 0; i < n; i++) {
+	dthread_reactor_entry_t* ep = evs[i].data.ptr;
+	uint32_t ev = evs[i].events;
+
+	if ((ep == NULL) || ep->dead)
+	    continue;
+	ep->pev.revents = 0;
+	if (ev & (EPOLLERR|EPOLLHUP))
+	    ep->pev.revents |= (ERL_DRV_READ|ERL_DRV_EXCEP);
+	if (ev & EPOLLIN)
+	    ep->pev.revents |= ERL_DRV_READ;
+	if (ev & EPOLLOUT)
+	    ep->pev.revents |= ERL_DRV_WRITE;
+	ep->pev.revents &= (ep->pev.events|ERL_DRV_EXCEP);
+	if (ep->pev.revents)
+	    (*ep->handler)(thr, &ep->pev, ep->arg);
+    }
+    r->dispatching = 0;
+    reactor_release(r);
+    return iq_len;
+}
+#else
+int dthread_reactor_wait(dthread_t* thr, int timeout)
+{
+    dthread_reactor_t* r;
+    size_t i, n, nready;
+    int iq_len;
+
+    if ((r = reactor_get(thr)) == NULL)
+	return -1;
+    n = r->n;
+    for (i = 0; i < n; i++)
+	r->pev[i] = r->entry[i]->pev;
+    nready = n;
+    if ((iq_len = dthread_poll(thr, r->pev, &nready, timeout)) < 0)
+	return -1;
+    if (nready == 0)
+	return iq_len;
+    // handlers may reorder (and grow) entry, remember what was polled
+    memcpy(r->ready, r->entry, n*sizeof(dthread_reactor_entry_t*));
+    r->dispatching = 1;
+    for (i = 0; i < n; i++) {
+	dthread_reactor_entry_t* ep = r->ready[i];
+	if (ep->dead || !r->pev[i].revents)
+	    continue;
+	ep->pev.revents = r->pev[i].revents;
+	(*ep->handler)(thr, &ep->pev, ep->arg);
+    }
+    r->dispatching = 0;
+    reactor_release(r);
+    return iq_len;
+}
+#endif
+
+
+/******************************************************************************
+ *
+ *   Asynchronous io
+ *
+ *  Operations are queued with dthread_io_submit and handed to the kernel
+ *  by dthread_io_wait, which also wait for the input queue and call the
+ *  done callback of completed operations. With io_uring everything
+ *  queued (and the queue signal poll) is submitted with the wait in one
+ *  system call. Without io_uring (not built, or refused by the kernel)
+ *  pending operations are polled with dthread_poll and performed when
+ *  ready. Only the consumer thread may use this.
+ *
+ *****************************************************************************/
+
+#ifdef DTHREAD_HAVE_IO_URING
+#define DTHREAD_URING_ENTRIES 256
+
+typedef struct {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void*  sq_ptr;
+    size_t sq_sz;
+    void*  cq_ptr;
+    size_t cq_sz;
+    size_t sqes_sz;
+    unsigned to_submit;        // sqes queued since last enter
+    int signal_armed;          // poll on queue signal is queued
+} dthread_uring_t;
+#endif
+
+typedef struct _dthread_io_ctx_t {
+#ifdef DTHREAD_HAVE_IO_URING
+    dthread_uring_t* ring;     // NULL when using the fallback
+#endif
+    dthread_io_t* pending;     // fallback: pending operations
+    size_t npev;               // fallback: allocated pev
+    dthread_poll_event_t* pev;
+} dthread_io_ctx_t;
+
+#ifndef __WIN32__
+static ErlDrvSInt64 io_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((ErlDrvSInt64)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+#endif
+
+#ifdef DTHREAD_HAVE_IO_URING
+
+static int uring_enter(dthread_uring_t* u, unsigned to_submit,
+		       unsigned min_complete, unsigned flags,
+		       void* arg, size_t argsz)
+{
+    return (int) syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete,
+			 flags, arg, argsz);
+}
+
+static void uring_free(dthread_uring_t* u)
+{
+    if (u->sqes && (u->sqes != MAP_FAILED))
+	munmap(u->sqes, u->sqes_sz);
+    if (u->cq_ptr && (u->cq_ptr != MAP_FAILED) && (u->cq_ptr != u->sq_ptr))
+	munmap(u->cq_ptr, u->cq_sz);
+    if (u->sq_ptr && (u->sq_ptr != MAP_FAILED))
+	munmap(u->sq_ptr, u->sq_sz);
+    if (u->fd >= 0)
+	close(u->fd);
+    DFREE(u);
+}
+
+static dthread_uring_t* uring_create(void)
+{
+    struct io_uring_params p;
+    dthread_uring_t* u;
+    char* sq;
+    char* cq;
+
+    if ((u = DZALLOC(sizeof(dthread_uring_t))) == NULL)
+	return NULL;
+    memset(&p, 0, sizeof(p));
+    if ((u->fd = (int) syscall(__NR_io_uring_setup,
+			       DTHREAD_URING_ENTRIES, &p)) < 0) {
+	DEBUGF("dthread_io: io_uring_setup failed errno=%d", errno);
+	DFREE(u);
+	return NULL;
+    }
+    // timed wait need EXT_ARG (5.11) which also implies the ops we use
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+	DEBUGF("dthread_io: io_uring too old features=%x", p.features);
+	uring_free(u);
+	return NULL;
+    }
+    u->sq_sz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    u->cq_sz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (u->cq_sz > u->sq_sz) u->sq_sz = u->cq_sz;
+	u->cq_sz = u->sq_sz;
+    }
+    u->sq_ptr = mmap(NULL, u->sq_sz, PROT_READ|PROT_WRITE,
+		     MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+	uring_free(u);
+	return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	u->cq_ptr = u->sq_ptr;
+    else {
+	u->cq_ptr = mmap(NULL, u->cq_sz, PROT_READ|PROT_WRITE,
+			 MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	if (u->cq_ptr == MAP_FAILED) {
+	    uring_free(u);
+	    return NULL;
+	}
+    }
+    u->sqes_sz = p.sq_entries*sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_sz, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+	uring_free(u);
+	return NULL;
+    }
+    sq = (char*) u->sq_ptr;
+    cq = (char*) u->cq_ptr;
+    u->sq_head  = (unsigned*) (sq + p.sq_off.head);
+    u->sq_tail  = (unsigned*) (sq + p.sq_off.tail);
+    u->sq_mask  = (unsigned*) (sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*) (sq + p.sq_off.array);
+    u->cq_head  = (unsigned*) (cq + p.cq_off.head);
+    u->cq_tail  = (unsigned*) (cq + p.cq_off.tail);
+    u->cq_mask  = (unsigned*) (cq + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    DEBUGF("dthread_io: io_uring fd=%d entries=%u", u->fd, p.sq_entries);
+    return u;
+}
+
+// get next free sqe, flush the ring to the kernel if it is full
+static struct io_uring_sqe* uring_get_sqe(dthread_uring_t* u)
+{
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *u->sq_tail;
+    struct io_uring_sqe* sqe;
+
+    if ((tail - head) > *u->sq_mask) {
+	if (uring_enter(u, u->to_submit, 0, 0, NULL, 0) < 0)
+	    return NULL;
+	u->to_submit = 0;
+	head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if ((tail - head) > *u->sq_mask)
+	    return NULL;
+    }
+    sqe = &u->sqes[tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+    return sqe;
+}
+
+static void uring_queue_sqe(dthread_uring_t* u)
+{
+    __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+}
+
+static int uring_submit(dthread_uring_t* u, dthread_io_t* io)
+{
+    struct io_uring_sqe* sqe;
+
+    if ((sqe = uring_get_sqe(u)) == NULL)
+	return -1;
+    sqe->user_data = (unsigned long long) (uintptr_t) io;
+    switch(io->op) {
+    case DTHREAD_IO_READ:
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = DTHREAD_EVENT(io->event);
+	sqe->addr = (unsigned long long) (uintptr_t) io->buf;
+	sqe->len = io->len;
+	sqe->off = (unsigned long long) -1;  // current position
+	break;
+    case DTHREAD_IO_WRITE:
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = DTHREAD_EVENT(io->event);
+	sqe->addr = (unsigned long long) (uintptr_t) io->buf;
+	sqe->len = io->len;
+	sqe->off = (unsigned long long) -1;
+	break;
+    case DTHREAD_IO_ACCEPT:
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = DTHREAD_EVENT(io->event);
+	break;
+    case DTHREAD_IO_TIMEOUT:
+	io->ts[0] = io->timeout / 1000;
+	io->ts[1] = (io->timeout % 1000) * 1000000;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long long) (uintptr_t) io->ts;
+	sqe->len = 1;
+	break;
+    default:
+	return -1;
+    }
+    uring_queue_sqe(u);
+    return 0;
+}
+
+static int uring_wait(dthread_t* thr, dthread_uring_t* u, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned head, tail;
+    int signaled = 0;
+    int iq_len;
+    int r;
+
+    if (!u->signal_armed &&
+	(thr->iq_signal[0] != (ErlDrvEvent)DTHREAD_INVALID_EVENT)) {
+	struct io_uring_sqe* sqe;
+	if ((sqe = uring_get_sqe(u)) == NULL)
+	    return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = DTHREAD_EVENT(thr->iq_signal[0]);
+	sqe->poll_events = POLLIN;
+	sqe->user_data = 0;  // 0 = queue signal
+	uring_queue_sqe(u);
+	u->signal_armed = 1;
+    }
+    timeout = tw_wait_timeout(thr, timeout);
+    if ((iq_len = iq_sleep(thr, timeout)) > 0)
+	timeout = 0;
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+	ts.tv_sec  = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+	arg.ts = (unsigned long long) (uintptr_t) &ts;
+    }
+    r = uring_enter(u, u->to_submit, (timeout == 0) ? 0 : 1,
+		    IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+		    &arg, sizeof(arg));
+    DEBUGF("dthread_io: io_uring_enter=%d", r);
+    if (r >= 0)
+	u->to_submit -= ((unsigned) r > u->to_submit) ? u->to_submit : (unsigned)r;
+    else if ((errno != ETIME) && (errno != EINTR) && (errno != EBUSY)) {
+	iq_wakeup(thr, 0);
+	return -1;
+    }
+
+    // check for queue signal first, then wakeup before callbacks
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+	if (u->cqes[head & *u->cq_mask].user_data == 0)
+	    signaled = 1;
+    }
+    if (signaled)
+	u->signal_armed = 0;
+    iq_len = iq_wakeup(thr, signaled);
+    dthread_timer_expire(thr);
+
+    head = *u->cq_head;
+    while(head != tail) {
+	struct io_uring_cqe* cqe = &u->cqes[head & *u->cq_mask];
+	dthread_io_t* io = (dthread_io_t*) (uintptr_t) cqe->user_data;
+	int res = cqe->res;
+
+	// release the slot before the callback (it may submit)
+	__atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+	if (io == NULL)
+	    continue;
+	if ((io->op == DTHREAD_IO_TIMEOUT) && (res == -ETIME))
+	    res = 0;
+	(*io->done)(thr, io, res);
+    }
+    return iq_len;
+}
+#endif
+
+static dthread_io_ctx_t* io_get(dthread_t* thr)
+{
+    dthread_io_ctx_t* ctx;
+
+    if ((ctx = thr->io) != NULL)
+	return ctx;
+    if ((ctx = DZALLOC(sizeof(dthread_io_ctx_t))) == NULL)
+	return NULL;
+#ifdef DTHREAD_HAVE_IO_URING
+    ctx->ring = uring_create();
+#endif
+    thr->io = ctx;
+    return ctx;
+}
+
+void dthread_io_finish(dthread_t* thr)
+{
+    dthread_io_ctx_t* ctx;
+
+    if ((ctx = thr->io) == NULL)
+	return;
+#ifdef DTHREAD_HAVE_IO_URING
+    if (ctx->ring)
+	uring_free(ctx->ring);
+#endif
+    DFREE(ctx->pev);
+    DFREE(ctx);
+    thr->io = NULL;
+}
+
+// queue an operation, it is started by next dthread_io_wait
+int dthread_io_submit(dthread_t* thr, dthread_io_t* io)
+{
+#ifdef __WIN32__
+    (void) thr;
+    (void) io;
+    return -1;
+#else
+    dthread_io_ctx_t* ctx;
+    dthread_io_t** pp;
+
+    if ((ctx = io_get(thr)) == NULL)
+	return -1;
+#ifdef DTHREAD_HAVE_IO_URING
+    if (ctx->ring)
+	return uring_submit(ctx->ring, io);
+#endif
+    switch(io->op) {
+    case DTHREAD_IO_READ:
+    case DTHREAD_IO_WRITE:
+    case DTHREAD_IO_ACCEPT:
+	break;
+    case DTHREAD_IO_TIMEOUT:
+	io->ts[0] = io_now_ms() + io->timeout;  // deadline
+	break;
+    default:
+	return -1;
+    }
+    // keep submission order
+    for (pp = &ctx->pending; *pp; pp = &(*pp)->next)
+	;
+    io->next = NULL;
+    *pp = io;
+    return 0;
+#endif
+}
+
+#ifndef __WIN32__
+// fallback: perform a ready operation, return result or -errno
+static int io_perform(dthread_io_t* io)
+{
+    int fd = DTHREAD_EVENT(io->event);
+    int r;
+
+    switch(io->op) {
+    case DTHREAD_IO_READ:
+	r = (int) read(fd, io->buf, io->len);
+	break;
+    case DTHREAD_IO_WRITE:
+	r = (int) write(fd, io->buf, io->len);
+	break;
+    case DTHREAD_IO_ACCEPT:
+	r = accept(fd, NULL, NULL);
+	break;
+    default:
+	r = 0;
+	break;
+    }
+    return (r < 0) ? -errno : r;
+}
+
+static int io_poll_wait(dthread_t* thr, dthread_io_ctx_t* ctx, int timeout)
+{
+    dthread_io_t* io;
+    dthread_io_t* done = NULL;
+    dthread_io_t** dp = &done;
+    dthread_io_t** pp;
+    ErlDrvSInt64 now = io_now_ms();
+    size_t i, n = 0, nready;
+    int iq_len;
+
+    for (io = ctx->pending; io; io = io->next) {
+	if (io->op == DTHREAD_IO_TIMEOUT) {
+	    int tmo = (io->ts[0] > now) ? (int)(io->ts[0] - now) : 0;
+	    if ((timeout < 0) || (tmo < timeout))
+		timeout = tmo;
+	}
+	else
+	    n++;
+    }
+    if (n > ctx->npev) {
+	dthread_poll_event_t* pev;
+	if ((pev = DREALLOC(ctx->pev, n*sizeof(*pev))) == NULL)
+	    return -1;
+	ctx->pev = pev;
+	ctx->npev = n;
+    }
+    for (i = 0, io = ctx->pending; io; io = io->next) {
+	if (io->op == DTHREAD_IO_TIMEOUT)
+	    continue;
+	ctx->pev[i].event = io->event;
+	ctx->pev[i].events =
+	    (io->op == DTHREAD_IO_WRITE) ? ERL_DRV_WRITE : ERL_DRV_READ;
+	ctx->pev[i].revents = 0;
+	i++;
+    }
+    nready = n;
+    if ((iq_len = dthread_poll(thr, ctx->pev, &nready, timeout)) < 0)
+	return -1;
+
+    // unlink completed operations before calling back (they may submit)
+    now = io_now_ms();
+    i = 0;
+    pp = &ctx->pending;
+    while((io = *pp) != NULL) {
+	int ready;
+	if (io->op == DTHREAD_IO_TIMEOUT)
+	    ready = (io->ts[0] <= now);
+	else
+	    ready = (ctx->pev[i++].revents != 0);
+	if (ready) {
+	    *pp = io->next;
+	    io->next = NULL;
+	    *dp = io;
+	    dp = &io->next;
+	}
+	else
+	    pp = &io->next;
+    }
+    while((io = done) != NULL) {
+	done = io->next;
+	(*io->done)(thr, io, io_perform(io));
+    }
+    return iq_len;
+}
+#endif
+
+//
+// Submit queued operations and wait for queue messages or completions,
+// call the done callbacks of completed operations.
 // return -1  on error
-//         0  timeout | no messages in queue (maybe in in nevents)
-//         n  number of messages ready to be read (0 also means timeout!)
+//         n  number of messages in queue (0 also means timeout!)
 //
+int dthread_io_wait(dthread_t* thr, int timeout)
+{
 #ifdef __WIN32__
+    return dthread_poll(thr, NULL, NULL, timeout);
+#else
+    dthread_io_ctx_t* ctx;
 
-int dthread_poll(dthread_t* thr, dthread_poll_event_t* events, size_t* nevents, 
-		 int timeout)
+    if ((ctx = io_get(thr)) == NULL)
+	return -1;
+#ifdef DTHREAD_HAVE_IO_URING
+    if (ctx->ring)
+	return uring_wait(thr, ctx->ring, timeout);
+#endif
+    return io_poll_wait(thr, ctx, timeout);
+#endif
+}
+
+
+/******************************************************************************
+ *
+ *   Framed channels
+ *
+ *  A framed ddata transport on a non-blocking pipe or socket. Frames
+ *  sent are queued and written with writev as the fd becomes writable,
+ *  partial writes continue where they stopped. Received data is read
+ *  into receive buffers pooled per thread (an idle channel holds no
+ *  buffer), frames larger than a receive buffer are read with readv
+ *  straight into a frame buffer. Driven by dthread_chan_handle from a
+ *  dthread_poll loop or by the reactor (dthread_chan_attach). Only the
+ *  consumer thread may use its channels.
+ *
+ *****************************************************************************/
+
+#define DTHREAD_CHAN_RBUF      8192         // pooled receive buffer size
+#define DTHREAD_CHAN_POOL      8            // receive buffers kept per thread
+#define DTHREAD_CHAN_BIG_KEEP  (256*1024)   // keep large frame buffer
+#define DTHREAD_CHAN_MAX_FRAME (64*1024*1024)
+#define DTHREAD_CHAN_READS     16           // reads per ready event
+#define DTHREAD_CHAN_IOV       64
+
+typedef struct _dthread_chans_t {
+    int nfree;
+    uint8_t* free[DTHREAD_CHAN_POOL];
+} dthread_chans_t;
+
+// queued frame, data is owned by the frame
+typedef struct _dchan_frame_t {
+    struct _dchan_frame_t* next;
+    size_t   len;        // header + payload
+    size_t   offs;       // bytes written
+    uint8_t  hdr[4];
+    ddata_t  data;
+    ddata_rope_t rope;   // data.rope points here in rope mode
+} dchan_frame_t;
+
+struct _dthread_chan_t {
+    dthread_t*  thr;
+    ErlDrvEvent event;
+    dthread_chan_cb_t cb;
+    void*       arg;
+    int         error;      // broken, errno or -1 for end of file
+    int         attached;   // registered with the reactor
+    int         events;     // events registered with the reactor
+    int         busy;       // in dthread_chan_handle, delay free
+    int         closed;     // closed while busy
+    // write side
+    dchan_frame_t*  wq;     // write queue
+    dchan_frame_t** wq_last;
+    size_t      wq_bytes;   // bytes not yet written
+    // read side
+    uint8_t*    rbuf;       // pooled receive buffer (or NULL)
+    size_t      rpos;       // parse position
+    size_t      rlen;       // bytes in rbuf
+    uint8_t*    big;        // large frame buffer
+    size_t      big_size;   // allocated
+    size_t      big_len;    // frame length (0 = no large frame)
+    size_t      big_pos;    // bytes received
+};
+
+#ifndef __WIN32__
+
+static uint8_t* chan_buf_get(dthread_t* thr)
 {
-    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
-    int    eindex[MAXIMUM_WAIT_OBJECTS];
-    DWORD  nCount = 0;
-    DWORD  iq_len = 0;
-    DWORD  nready = 0;
-    DWORD  dwMilliseconds;
-    DWORD  res;
-    int    i,n;
+    dthread_chans_t* cp = thr->chans;
 
-    if (timeout < 0)
-	dwMilliseconds = INFINITE;
+    if (cp && (cp->nfree > 0))
+	return cp->free[--cp->nfree];
+    return DALLOC(DTHREAD_CHAN_RBUF);
+}
+
+static void chan_buf_put(dthread_t* thr, uint8_t* buf)
+{
+    dthread_chans_t* cp = thr->chans;
+
+    if ((cp == NULL) && ((cp = DZALLOC(sizeof(dthread_chans_t))) != NULL))
+	thr->chans = cp;
+    if (cp && (cp->nfree < DTHREAD_CHAN_POOL))
+	cp->free[cp->nfree++] = buf;
     else
-	dwMilliseconds = (DWORD) timeout;
+	DFREE(buf);
+}
 
-    // install handles to wait for
-    if (DTHREAD_EVENT(thr->iq_signal[0]) != DTHREAD_INVALID_EVENT) {
-	eindex[nCount] = -1;  // -1 == signal queue event
-	handles[nCount] = DTHREAD_EVENT(thr->iq_signal[0]);
-	nCount++;
+static void chan_frame_free(dchan_frame_t* fp)
+{
+    ddata_final(&fp->data);
+    DFREE(fp);
+}
+
+// update reactor registration when the write queue changes state
+static void chan_update(dthread_chan_t* chan)
+{
+    int events;
+
+    if (!chan->attached)
+	return;
+    events = dthread_chan_events(chan);
+    if (events != chan->events) {
+	if (dthread_reactor_mod(chan->thr, chan->event, events) == 0)
+	    chan->events = events;
     }
+}
 
-    if (events && nevents && *nevents) {
-	n = (DWORD) (*nevents);
-	for (i = 0; (nCount < MAXIMUM_WAIT_OBJECTS) && (i < n); i++) {
-	    events[i].revents = 0; // clear here in case of timeout etc
-	    if (events[i].events) {
-		eindex[nCount]  = i;  // index in event array
-		handles[nCount] = DTHREAD_EVENT(events[i].event);
-		nCount++;
-	    }
-	}
+static void chan_free(dthread_chan_t* chan)
+{
+    while(chan->wq) {
+	dchan_frame_t* fp = chan->wq;
+	chan->wq = fp->next;
+	chan_frame_free(fp);
     }
+    if (chan->rbuf)
+	chan_buf_put(chan->thr, chan->rbuf);
+    DFREE(chan->big);
+    DFREE(chan);
+}
 
-    DEBUGF("WaitForMultipleObjects nCount=%d, timeout=%d", nCount, 
-	   dwMilliseconds);
-    // wait for first event that is signaled
-    res = WaitForMultipleObjects(nCount, handles, FALSE, dwMilliseconds);
-    DEBUGF("WaitForMultipleObjects result=%d", res);
-    
-    if (res == WAIT_TIMEOUT)
-	return 0;
-    else if (res == WAIT_FAILED)
+// channel is broken, error is errno or -1 for end of file
+static int chan_error(dthread_chan_t* chan, int error)
+{
+    if (chan->error)
 	return -1;
-    else if ((res >= WAIT_OBJECT_0) && (res < (WAIT_OBJECT_0+nCount))) {
-	DWORD j = res - WAIT_OBJECT_0;
-	
-	if ((i = eindex[j]) < 0) {
-	    erl_drv_mutex_lock(thr->iq_mtx);
-	    iq_len = thr->iq_len;
-	    erl_drv_mutex_unlock(thr->iq_mtx);
-	}
-	else if (events != NULL) {
-	    events[i].revents |= ERL_DRV_READ;  // event is ready
-	    nready++;
-	}
-	j++;
+    chan->error = error;
+    DEBUGF("dthread_chan: fd=%d error=%d", DTHREAD_EVENT(chan->event), error);
+    if (chan->attached) {
+	dthread_reactor_del(chan->thr, chan->event);
+	chan->attached = 0;
+    }
+    errno = (error < 0) ? 0 : error;
+    (*chan->cb)(chan, NULL, chan->arg);
+    return -1;
+}
 
-	// must scan rest of the events as well, else starvation may occure 
-	while (j < nCount) {
-	    if (WaitForSingleObject(handles[j], 0) == WAIT_OBJECT_0) {
-		if ((i = eindex[j]) < 0) {
-		    erl_drv_mutex_lock(thr->iq_mtx);
-		    iq_len = thr->iq_len;
-		    erl_drv_mutex_unlock(thr->iq_mtx);
-		}
-		else if (events != NULL) {
-		    events[i].revents |= ERL_DRV_READ;  // event is ready
-		    nready++;
-		}		
+// fill iov with unwritten parts of fp, *complete is set if all fit
+static int chan_frame_iov(dchan_frame_t* fp, struct iovec* iov, int max,
+			  int* complete)
+{
+    size_t skip = fp->offs;
+    int n = 0;
+
+    *complete = 0;
+    if (skip < 4) {
+	if (n == max) return n;
+	iov[n].iov_base = fp->hdr + skip;
+	iov[n].iov_len  = 4 - skip;
+	n++;
+	skip = 0;
+    }
+    else
+	skip -= 4;
+    if (fp->data.rope) {
+	ddata_seg_t* seg;
+	for (seg = fp->rope.first; seg != NULL; seg = seg->next) {
+	    if (skip >= seg->len) {
+		skip -= seg->len;
+		continue;
 	    }
-	    j++;
+	    if (n == max) return n;
+	    iov[n].iov_base = seg->ptr + skip;
+	    iov[n].iov_len  = seg->len - skip;
+	    n++;
+	    skip = 0;
 	}
     }
-    if (nevents)
-	*nevents = nready;
-    return iq_len;
+    else if ((size_t)(fp->data.wr - fp->data.rd) > skip) {
+	if (n == max) return n;
+	iov[n].iov_base = fp->data.rd + skip;
+	iov[n].iov_len  = (fp->data.wr - fp->data.rd) - skip;
+	n++;
+    }
+    *complete = 1;
+    return n;
 }
-#else
 
-int dthread_poll(dthread_t* thr, dthread_poll_event_t* events, size_t* nevents, 
-		 int timeout)
+// write queued frames until done or the fd would block
+static int chan_write(dthread_chan_t* chan)
 {
-    struct timeval tm;
-    struct timeval* tp;
-    fd_set readfds;
-    fd_set writefds;
-    fd_set errorfds;
-    int fd,nfds = 0;
-    int ready;
-    int i,n,iq_len=0;
+    int fd = DTHREAD_EVENT(chan->event);
+    struct iovec iov[DTHREAD_CHAN_IOV];
 
-    if (timeout < 0)
-	tp = NULL;
-    else {
-	tm.tv_sec = timeout / 1000;
-	tm.tv_usec = (timeout - tm.tv_sec*1000) * 1000;
-	tp = &tm;
+    while(chan->wq) {
+	dchan_frame_t* fp;
+	size_t want = 0;
+	ssize_t r, w;
+	int complete = 1;
+	int i, n = 0;
+
+	for (fp = chan->wq; fp && complete && (n < DTHREAD_CHAN_IOV);
+	     fp = fp->next)
+	    n += chan_frame_iov(fp, iov+n, DTHREAD_CHAN_IOV-n, &complete);
+	for (i = 0; i < n; i++)
+	    want += iov[i].iov_len;
+	if ((r = writev(fd, iov, n)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+		return 0;
+	    return chan_error(chan, errno);
+	}
+	chan->wq_bytes -= r;
+	w = r;
+	// drop written frames
+	while((fp = chan->wq) != NULL) {
+	    size_t left = fp->len - fp->offs;
+	    if ((size_t)r < left) {
+		fp->offs += r;
+		break;
+	    }
+	    r -= left;
+	    if ((chan->wq = fp->next) == NULL)
+		chan->wq_last = &chan->wq;
+	    chan_frame_free(fp);
+	}
+	if ((size_t)w < want)
+	    break;  // short write, wait for writable
     }
-    FD_ZERO(&readfds);
-    FD_ZERO(&writefds);
-    FD_ZERO(&errorfds);
+    return 0;
+}
 
-    if ((fd = DTHREAD_EVENT(thr->iq_signal[0])) >= 0) {
-	FD_SET(fd, &readfds);
-	FD_SET(fd, &errorfds);
-	DEBUGF("FD_SET: iq_signal[0] = %d", fd);
-	if (fd > nfds) nfds = fd;
+// deliver a frame to the callback
+static void chan_deliver(dthread_chan_t* chan, uint8_t* ptr, size_t len)
+{
+    ddata_t frame;
+
+    ddata_r_init(&frame, ptr, len, 0);
+    (*chan->cb)(chan, &frame, chan->arg);
+}
+
+// deliver complete frames in rbuf, start a large frame if needed
+static int chan_parse(dthread_chan_t* chan)
+{
+    while(!chan->closed && ((chan->rlen - chan->rpos) >= 4)) {
+	uint8_t* ptr = chan->rbuf + chan->rpos;
+	size_t avail = chan->rlen - chan->rpos;
+	size_t len = DDATA_GET_UINT32(ptr);
+
+	if (len > DTHREAD_CHAN_MAX_FRAME)
+	    return chan_error(chan, EMSGSIZE);
+	if (len+4 <= avail) {
+	    chan->rpos += len+4;
+	    chan_deliver(chan, ptr+4, len);
+	}
+	else if (len+4 > DTHREAD_CHAN_RBUF) {
+	    if (chan->big_size < len) {
+		uint8_t* big;
+		if ((big = DALLOC(len)) == NULL)
+		    return chan_error(chan, ENOMEM);
+		DFREE(chan->big);
+		chan->big = big;
+		chan->big_size = len;
+	    }
+	    memcpy(chan->big, ptr+4, avail-4);
+	    chan->big_len = len;
+	    chan->big_pos = avail-4;
+	    chan->rpos = chan->rlen = 0;
+	    break;
+	}
+	else
+	    break;
     }
+    return 0;
+}
 
-    if (events && nevents && *nevents) {
-	n = (int) (*nevents);
-	for (i = 0; i < n; i++) {
-	    events[i].revents = 0;  // clear here in case of timeout etc
-	    if (events[i].events) {
-		fd = DTHREAD_EVENT(events[i].event);
-		if (events[i].events & ERL_DRV_READ) {
-		    FD_SET(fd, &readfds);
-		    FD_SET(fd, &errorfds);
-		}
-		if (events[i].events & ERL_DRV_WRITE)
-		    FD_SET(fd, &writefds);
-		if (fd > nfds) nfds = fd;
+// read and deliver frames until the fd would block
+static int chan_read(dthread_chan_t* chan)
+{
+    int fd = DTHREAD_EVENT(chan->event);
+    int reads = DTHREAD_CHAN_READS;
+
+    while(!chan->closed && (reads-- > 0)) {
+	struct iovec iov[2];
+	size_t want;
+	ssize_t r;
+	int n = 0;
+
+	if ((chan->rbuf == NULL) &&
+	    ((chan->rbuf = chan_buf_get(chan->thr)) == NULL))
+	    return chan_error(chan, ENOMEM);
+	if (chan->big_len) {
+	    // rest of large frame, and what follows into rbuf
+	    iov[n].iov_base = chan->big + chan->big_pos;
+	    iov[n].iov_len  = chan->big_len - chan->big_pos;
+	    n++;
+	}
+	else if (chan->rpos > 0) {
+	    memmove(chan->rbuf, chan->rbuf+chan->rpos, chan->rlen-chan->rpos);
+	    chan->rlen -= chan->rpos;
+	    chan->rpos = 0;
+	}
+	iov[n].iov_base = chan->rbuf + chan->rlen;
+	iov[n].iov_len  = DTHREAD_CHAN_RBUF - chan->rlen;
+	want = iov[0].iov_len + ((n > 0) ? iov[1].iov_len : 0);
+	n++;
+	if ((r = readv(fd, iov, n)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+		break;
+	    return chan_error(chan, errno);
+	}
+	if (r == 0)
+	    return chan_error(chan, -1);
+	if (chan->big_len) {
+	    size_t k = chan->big_len - chan->big_pos;
+	    if ((size_t)r < k) {
+		chan->big_pos += r;
+		break;  // drained
+	    }
+	    chan->rlen += (r - k);
+	    chan->big_len = 0;
+	    chan_deliver(chan, chan->big, chan->big_pos + k);
+	    if (chan->big_size > DTHREAD_CHAN_BIG_KEEP) {
+		DFREE(chan->big);
+		chan->big = NULL;
+		chan->big_size = 0;
 	    }
 	}
+	else
+	    chan->rlen += r;
+	if (chan_parse(chan) < 0)
+	    return -1;
+	if ((size_t)r < want)
+	    break;  // drained
+    }
+    // return buffer to pool when idle
+    if (chan->rbuf && (chan->rpos == chan->rlen)) {
+	chan_buf_put(chan->thr, chan->rbuf);
+	chan->rbuf = NULL;
+	chan->rpos = chan->rlen = 0;
     }
+    return 0;
+}
 
-    DEBUGF("select nfds=%d, tp=%p", nfds, tp);
-    ready = select(nfds+1, &readfds, &writefds, &errorfds, tp);
-    DEBUGF("select result r=%d", ready);
-    if (ready <= 0) {
-	if (nevents)
-	    *nevents = 0;
-	return ready;
+static void chan_reactor_handler(dthread_t* thr, dthread_poll_event_t* pev,
+				 void* arg)
+{
+    (void) thr;
+    dthread_chan_handle((dthread_chan_t*) arg, pev);
+}
+
+#endif
+
+// create a channel on event (pipe or socket) used by thr
+dthread_chan_t* dthread_chan_open(dthread_t* thr, ErlDrvEvent event,
+				  dthread_chan_cb_t cb, void* arg)
+{
+#ifdef __WIN32__
+    (void) thr;
+    (void) event;
+    (void) cb;
+    (void) arg;
+    return NULL;
+#else
+    dthread_chan_t* chan;
+    int fd = DTHREAD_EVENT(event);
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0)
+	return NULL;
+    if (!(flags & O_NONBLOCK) && (fcntl(fd, F_SETFL, flags|O_NONBLOCK) < 0))
+	return NULL;
+    if ((chan = DZALLOC(sizeof(dthread_chan_t))) == NULL)
+	return NULL;
+    chan->thr = thr;
+    chan->event = event;
+    chan->cb = cb;
+    chan->arg = arg;
+    chan->wq_last = &chan->wq;
+    return chan;
+#endif
+}
+
+// free the channel and unsent frames, the event is not closed
+void dthread_chan_close(dthread_chan_t* chan)
+{
+#ifndef __WIN32__
+    if (chan->attached) {
+	dthread_reactor_del(chan->thr, chan->event);
+	chan->attached = 0;
     }
+    if (chan->busy)
+	chan->closed = 1;
+    else
+	chan_free(chan);
+#else
+    (void) chan;
+#endif
+}
 
-    // check queue !
-    fd = DTHREAD_EVENT(thr->iq_signal[0]);
-    if (FD_ISSET(fd, &readfds)) {
-	erl_drv_mutex_lock(thr->iq_mtx);
-	iq_len = thr->iq_len;
-	erl_drv_mutex_unlock(thr->iq_mtx);
-	ready--;
+//
+// Queue data as a frame and write what can be written now.
+// The channel takes over the data (contiguous or rope), data is left
+// empty. A buffer not owned by data is copied if it must be queued.
+// return -1 if channel is broken, 0 otherwise
+//
+int dthread_chan_send(dthread_chan_t* chan, ddata_t* data)
+{
+#ifdef __WIN32__
+    (void) chan;
+    (void) data;
+    return -1;
+#else
+    dchan_frame_t* fp;
+    size_t len;
+
+    if (chan->error)
+	return -1;
+    if ((fp = DALLOC(sizeof(dchan_frame_t))) == NULL)
+	return -1;
+    if (data->rope) {
+	if (ddata_rope_flush(data) < 0) {
+	    DFREE(fp);
+	    return -1;
+	}
+	len = data->rope->len;
+	fp->rope = *data->rope;
+	if (fp->rope.first == NULL)
+	    fp->rope.last = &fp->rope.first;
+	fp->data = *data;
+	fp->data.rope = &fp->rope;
+    }
+    else {
+	len = data->wr - data->rd;
+	fp->data = *data;
     }
+    data->dyn_alloc = 0;
+    data->rope = NULL;
+    data->base = data->rd = data->wr = data->eob = NULL;
 
-    // check io events
-    if (ready && events && nevents && *nevents) {
-	size_t nready = 0;
-	n = (int) (*nevents);
-	for (i = 0; ready && (i < n); i++) {
-	    size_t fd_ready = 0;
-	    fd = DTHREAD_EVENT(events[i].event);
-	    if (FD_ISSET(fd, &readfds) || FD_ISSET(fd, &errorfds)) {
-		events[i].revents |= ERL_DRV_READ;
-		if (FD_ISSET(fd, &errorfds))
-		    events[i].revents |= ERL_DRV_EXCEP;
-		fd_ready = 1;
+    fp->next = NULL;
+    fp->len  = len + 4;
+    fp->offs = 0;
+    DDATA_PUT_UINT32(fp->hdr, len);
+    *chan->wq_last = fp;
+    chan->wq_last = &fp->next;
+    chan->wq_bytes += fp->len;
+
+    if ((chan->wq == fp) && (chan_write(chan) < 0))
+	return -1;
+    // keep a private copy of a borrowed buffer still queued
+    if ((chan->wq_last == &fp->next) && !fp->data.rope &&
+	!fp->data.dyn_alloc) {
+	uint8_t* buf;
+	if ((buf = DALLOC(len)) == NULL) {
+	    if (chan->wq == fp) {
+		if (fp->offs > 0)  // partly written, stream is lost
+		    return chan_error(chan, ENOMEM);
+		chan->wq = NULL;
+		chan->wq_last = &chan->wq;
 	    }
-	    if (FD_ISSET(fd, &writefds)) {
-		events[i].revents |= ERL_DRV_WRITE; 
-		fd_ready = 1;
+	    else {
+		dchan_frame_t* pp = chan->wq;
+		while(pp->next != fp)
+		    pp = pp->next;
+		pp->next = NULL;
+		chan->wq_last = &pp->next;
 	    }
-	    nready += fd_ready;
-	    ready--;
+	    chan->wq_bytes -= fp->len;
+	    DFREE(fp);
+	    return -1;
 	}
-	*nevents = nready;
+	memcpy(buf, fp->data.rd, len);
+	ddata_r_init(&fp->data, buf, len, 1);
     }
-    return iq_len;
+    chan_update(chan);
+    return 0;
+#endif
 }
+
+// write queued frames, return -1 if channel is broken
+int dthread_chan_flush(dthread_chan_t* chan)
+{
+#ifdef __WIN32__
+    (void) chan;
+    return -1;
+#else
+    if (chan->error)
+	return -1;
+    if (chan_write(chan) < 0)
+	return -1;
+    chan_update(chan);
+    return 0;
 #endif
+}
 
+// number of bytes queued but not yet written
+size_t dthread_chan_pending(dthread_chan_t* chan)
+{
+    return chan->wq_bytes;
+}
 
-int dthread_send(dthread_t* thr, dthread_t* source, dmessage_t* mp)
+// events to wait for, ERL_DRV_READ and ERL_DRV_WRITE if data is queued
+int dthread_chan_events(dthread_chan_t* chan)
 {
-    dmessage_t* mr;
-    int len;
-    int r = 0;
+    if (chan->error)
+	return 0;
+    return ERL_DRV_READ | (chan->wq ? ERL_DRV_WRITE : 0);
+}
 
-    erl_drv_mutex_lock(thr->iq_mtx);
+// setup a dthread_poll event for the channel
+void dthread_chan_poll_event(dthread_chan_t* chan, dthread_poll_event_t* pev)
+{
+    pev->event   = chan->event;
+    pev->events  = dthread_chan_events(chan);
+    pev->revents = 0;
+}
 
-    mp->next = NULL;
-    mp->source = source;
+//
+// Handle a ready channel event (revents from dthread_poll)
+// return -1 if channel is broken, 0 otherwise
+//
+int dthread_chan_handle(dthread_chan_t* chan, dthread_poll_event_t* pev)
+{
+#ifdef __WIN32__
+    (void) chan;
+    (void) pev;
+    return -1;
+#else
+    int r = 0;
 
-    if ((mr = thr->iq_rear) != NULL)
-	mr->next = mp;
-    else
-	thr->iq_front = mp;
-    thr->iq_rear = mp;
-    len = ++thr->iq_len;
-    if (len == 1)
-	r = dthread_signal_set(thr);
-    erl_drv_mutex_unlock(thr->iq_mtx);
-    DEBUGF("dthread_send: iq_len=%d", len);
+    if (chan->error)
+	return -1;
+    chan->busy++;
+    if ((pev->revents & ERL_DRV_WRITE) && chan->wq)
+	r = chan_write(chan);
+    if ((r == 0) && !chan->closed && (pev->revents & (ERL_DRV_READ|ERL_DRV_EXCEP)))
+	r = chan_read(chan);
+    chan->busy--;
+    if (chan->closed) {
+	if (chan->busy == 0)
+	    chan_free(chan);
+	return -1;
+    }
+    if (r == 0)
+	chan_update(chan);
     return r;
+#endif
 }
 
-dmessage_t* dthread_recv(dthread_t* thr, dthread_t** source)
+// let the reactor of the channel thread drive the channel
+int dthread_chan_attach(dthread_chan_t* chan)
+{
+#ifdef __WIN32__
+    (void) chan;
+    return -1;
+#else
+    int events;
+
+    if (chan->attached || chan->error)
+	return -1;
+    events = dthread_chan_events(chan);
+    if (dthread_reactor_add(chan->thr, chan->event, events,
+			    chan_reactor_handler, chan) < 0)
+	return -1;
+    chan->attached = 1;
+    chan->events = events;
+    return 0;
+#endif
+}
+
+// free pooled receive buffers
+void dthread_chan_finish(dthread_t* thr)
+{
+    dthread_chans_t* cp;
+
+    if ((cp = thr->chans) == NULL)
+	return;
+    while(cp->nfree > 0)
+	DFREE(cp->free[--cp->nfree]);
+    DFREE(cp);
+    thr->chans = NULL;
+}
+
+static dmessage_t* control_message(dthread_t* source,
+				   int cmd, char* buf, int len)
 {
     dmessage_t* mp;
-    
-    erl_drv_mutex_lock(thr->iq_mtx);
-    if ((mp = thr->iq_front) != NULL) {
-	if (!(thr->iq_front = mp->next))
-	    thr->iq_rear = NULL;
-	thr->iq_len--;
-	if (thr->iq_len == 0)
-	    dthread_signal_reset(thr);
-    }
-    erl_drv_mutex_unlock(thr->iq_mtx);
 
-    if (mp && source)
-	*source = mp->source;
+    if (!(mp = dmessage_create(cmd, buf, len)))
+	return NULL;
+    mp->flags |= DMESSAGE_REQUEST;
+    mp->from = source->caller;
+    mp->ref  = ++source->ref;
     return mp;
 }
 
-
 int dthread_control(dthread_t* thr, dthread_t* source,
 		    int cmd, char* buf, int len)
 {
     dmessage_t* mp;
 
-    if (!(mp = dmessage_create(cmd, buf, len)))
+    if (!(mp = control_message(source, cmd, buf, len)))
 	return -1;
-    mp->from = source->caller;
-    mp->ref  = ++source->ref;
     return dthread_send(thr, source, mp);
 }
 
@@ -572,39 +3591,212 @@ int dthread_output(dthread_t* thr, dthread_t* source,
     return dthread_control(thr, source, DTHREAD_OUTPUT, buf, len);
 }
 
-static void release_xptr_func(dmessage_t* mp)
+int dthread_pool_control(dthread_pool_t* pool, dthread_t* source,
+			 int cmd, char* buf, int len)
 {
-    DEBUGF("release_xptr_func called");
-    DFREE(mp->udata);
+    dmessage_t* mp;
+
+    if (!(mp = control_message(source, cmd, buf, len)))
+	return -1;
+    return dthread_pool_send(pool, source, mp);
 }
 
-int dthread_port_send_term(dthread_t* thr, dthread_t* source, 
-			   ErlDrvTermData target,
-			   ErlDrvTermData* spec, int len)
+int dthread_pool_output(dthread_pool_t* pool, dthread_t* source,
+			char* buf, int len)
+{
+    return dthread_pool_control(pool, source, DTHREAD_OUTPUT, buf, len);
+}
+
+static void release_iov_func(dmessage_t* mp)
+{
+    ErlDrvBinary** binv = (ErlDrvBinary**) mp->data;
+    int i;
+
+    for (i = 0; i < mp->iovcnt; i++)
+	driver_free_binary(binv[i]);
+    mp->buffer = mp->data;  // buffer is owned by the binaries
+}
+
+// Send output data from an io vector without copying it. The message
+// keeps a reference to each binary until freed. When the data is in
+// one segment it is found in buffer/used as for dthread_output,
+// otherwise buffer is NULL and the segments are found in iov/iovcnt.
+// Segments without a binary can not be referenced and are copied.
+static dmessage_t* outputv_message(dthread_t* source, ErlIOVec* ev)
+{
+    ErlDrvBinary** binv;
+    dmessage_t* mp;
+    int i, n = 0;
+
+    for (i = 0; i < ev->vsize; i++) {
+	if (ev->iov[i].iov_len == 0)
+	    continue;
+	if (!ev->binv[i])
+	    break;
+	n++;
+    }
+
+    if (i < ev->vsize) {
+	if (!(mp = dmessage_alloc(ev->size)))
+	    return NULL;
+	mp->used = driver_vec_to_buf(ev, mp->buffer, ev->size);
+    }
+    else {
+	if (!(mp = dmessage_alloc(n*(sizeof(ErlDrvBinary*)+sizeof(SysIOVec)))))
+	    return NULL;
+	binv = (ErlDrvBinary**) mp->data;
+	mp->iov = (SysIOVec*) (binv + n);
+	for (i = 0; i < ev->vsize; i++) {
+	    if (ev->iov[i].iov_len == 0)
+		continue;
+	    driver_binary_inc_refc(ev->binv[i]);
+	    binv[mp->iovcnt] = ev->binv[i];
+	    mp->iov[mp->iovcnt++] = ev->iov[i];
+	}
+	mp->release = release_iov_func;
+	mp->buffer = (n == 0) ? mp->data :
+	    ((n == 1) ? (char*) mp->iov[0].iov_base : NULL);
+	mp->size   = ev->size;
+	mp->used   = ev->size;
+    }
+    mp->cmd  = DTHREAD_OUTPUT;
+    mp->flags |= DMESSAGE_REQUEST;
+    mp->from = source->caller;
+    mp->ref  = ++source->ref;
+    return mp;
+}
+
+int dthread_outputv(dthread_t* thr, dthread_t* source, ErlIOVec* ev)
+{
+    dmessage_t* mp;
+
+    if (!(mp = outputv_message(source, ev)))
+	return -1;
+    return dthread_send(thr, source, mp);
+}
+
+int dthread_pool_outputv(dthread_pool_t* pool, dthread_t* source,
+			 ErlIOVec* ev)
+{
+    dmessage_t* mp;
+
+    if (!(mp = outputv_message(source, ev)))
+	return -1;
+    return dthread_pool_send(pool, source, mp);
+}
+
+// release binary references taken by dterm_dyn_copy
+static void release_spec_func(dmessage_t* mp)
+{
+    dterm_dyn_release((ErlDrvTermData*) mp->buffer,
+		      mp->used / sizeof(ErlDrvTermData));
+}
+
+static int reply_flush_target(dthread_t* self, dthread_t* thr,
+			      ErlDrvTermData target);
+
+static int port_send_term(dthread_t* thr, dthread_t* source,
+			  ErlDrvTermData target,
+			  ErlDrvTermData* spec, int len)
 {
     if (thr->smp_support)
 	return DSEND_TERM(thr, target, spec, len);
     else {
 	dmessage_t* mp;
+	size_t sz = len*sizeof(ErlDrvTermData);
 	int xsz = dterm_dyn_size(spec, len);
 	if (xsz < 0)
 	    return -1;
-	mp = dmessage_create(DTHREAD_SEND_TERM,(char*)spec,
-			     len*sizeof(ErlDrvTermData));
-	if (xsz > 0) {
-	    char* xptr = DALLOC(xsz);
-	    if ((dterm_dyn_copy((ErlDrvTermData*)mp->buffer, 
-				len, xptr)) == NULL)
-		return -1;
-	    mp->udata = xptr;
-	    mp->release = release_xptr_func;
-	}
+	// the spec and the data it points to in one message, binaries
+	// are referenced until the message is released
+	if (!(mp = dmessage_alloc(sz + xsz)))
+	    return -1;
+	mp->cmd = DTHREAD_SEND_TERM;
+	mp->release = release_spec_func;
+	memcpy(mp->buffer, spec, sz);
+	mp->used = sz;
+	dterm_dyn_copy((ErlDrvTermData*)mp->buffer, len, mp->buffer+sz);
 	mp->to = target;
 	// dterm_dump(stderr, (ErlDrvTermData*) mp->buffer, mp->used / sizeof(ErlDrvTermData));
 	return dthread_send(thr, source, mp);
     }
 }
 
+int dthread_port_send_term(dthread_t* thr, dthread_t* source, 
+			   ErlDrvTermData target,
+			   ErlDrvTermData* spec, int len)
+{
+    reply_flush_target(source, thr, target);  // keep order
+    return port_send_term(thr, source, target, spec, len);
+}
+
+//
+// Term messages: the term is built with the dterm_t in the message so
+// the receiving thread get it without any copy. Data the term point to
+// must be allocated in the dterm_t (dterm_link_alloc_data etc) to be
+// owned by the message, a binary reference put in the term is handed
+// over and released with the message.
+//
+static void release_term_func(dmessage_t* mp)
+{
+    dterm_t* t = (dterm_t*) mp->udata;
+
+    dterm_dyn_release(dterm_data(t), dterm_used_size(t));
+    dterm_finish(t);
+    mp->buffer = mp->data;  // an expanded spec was freed by dterm_finish
+}
+
+dmessage_t* dmessage_create_term(int cmd)
+{
+    dmessage_t* mp;
+
+    if (!(mp = dmessage_alloc(sizeof(dterm_t))))
+	return NULL;
+    mp->cmd = cmd;
+    mp->udata = mp->data;
+    mp->release = release_term_func;
+    dterm_init((dterm_t*) mp->udata);
+    return mp;
+}
+
+dterm_t* dmessage_term(dmessage_t* mp)
+{
+    return (dterm_t*) mp->udata;
+}
+
+// The term is complete, buffer/used is set to the spec and the
+// message may be sent to any thread.
+void dmessage_term_end(dmessage_t* mp)
+{
+    dterm_t* t = (dterm_t*) mp->udata;
+
+    mp->buffer = (char*) dterm_data(t);
+    mp->used = dterm_used_size(t)*sizeof(ErlDrvTermData);
+}
+
+// Send a term message to target, the message is consumed
+int dthread_port_send_dmessage(dthread_t* thr, dthread_t* source,
+			       ErlDrvTermData target, dmessage_t* mp)
+{
+    reply_flush_target(source, thr, target);  // keep order
+    dmessage_term_end(mp);
+    if (thr->smp_support) {
+	int r = DSEND_TERM(thr, target, (ErlDrvTermData*) mp->buffer,
+			   mp->used / sizeof(ErlDrvTermData));
+	dmessage_free(mp);
+	return r;
+    }
+    mp->cmd = DTHREAD_SEND_TERM;
+    mp->to = target;
+    return dthread_send(thr, source, mp);
+}
+
+int dthread_port_output_dmessage(dthread_t* thr, dthread_t* source,
+				 dmessage_t* mp)
+{
+    return dthread_port_send_dmessage(thr, source, thr->owner, mp);
+}
+
 int dthread_port_output_term(dthread_t* thr, dthread_t* source, 
 			     ErlDrvTermData* spec, int len)
 {
@@ -624,29 +3816,239 @@ int dthread_port_output_dterm(dthread_t* thr, dthread_t* source, dterm_t* p)
     return dthread_port_send_dterm(thr, source, thr->owner, p);
 }
 
-// send {Ref, ok}
-int dthread_port_send_ok(dthread_t* thr, dthread_t* source, 
-			 ErlDrvTermData target, ErlDrvTermData ref)
+/******************************************************************************
+ *
+ *   Reply coalescing
+ *
+ *****************************************************************************/
+
+#define REPLY_HASH      16   // buckets of targets with buffered replies
+#define REPLY_FREE_MAX  4    // cached reply buffers
+
+// buffered replies to one target, sent through thr (the port thread)
+typedef struct _dreply_t {
+    struct _dreply_t* next;
+    dthread_t*     thr;
+    ErlDrvTermData target;
+    int            count;     // number of buffered replies
+    dterm_t        t;         // reply specs, pointer data in links
+} dreply_t;
+
+typedef struct _dthread_replies_t {
+    int             count;    // total number of buffered replies
+    dthread_timer_t timer;    // flush timer
+    dreply_t*       hash[REPLY_HASH];
+    dreply_t*       free;     // cached reply buffers
+    int             nfree;
+} dthread_replies_t;
+
+static dreply_t** reply_find(dthread_replies_t* rs, dthread_t* thr,
+			     ErlDrvTermData target)
+{
+    unsigned int h = dthread_key_hash((char*) &target, sizeof(target));
+    dreply_t** pp = &rs->hash[h % REPLY_HASH];
+
+    while(*pp && (((*pp)->target != target) || ((*pp)->thr != thr)))
+	pp = &(*pp)->next;
+    return pp;
+}
+
+static void reply_release(dthread_replies_t* rs, dreply_t* rp)
+{
+    dterm_dyn_release(dterm_data(&rp->t), dterm_used_size(&rp->t));
+    if (rs->nfree < REPLY_FREE_MAX) {
+	dterm_reset(&rp->t);
+	rp->next = rs->free;
+	rs->free = rp;
+	rs->nfree++;
+    }
+    else {
+	dterm_finish(&rp->t);
+	DFREE(rp);
+    }
+}
+
+// send the replies in *pp as one list and unlink them
+static int reply_send(dthread_t* self, dthread_replies_t* rs, dreply_t** pp)
 {
-    dterm_t t;
-    dterm_mark_t m;
+    dreply_t* rp = *pp;
     int r;
 
-    dterm_init(&t);
-    dterm_tuple_begin(&t, &m); {
-	dterm_int(&t, ref);
-	dterm_atom(&t, am_ok);
+    dterm_nil(&rp->t);
+    dterm_list(&rp->t, rp->count+1);
+    r = port_send_term(rp->thr, self, rp->target,
+		       dterm_data(&rp->t), dterm_used_size(&rp->t));
+    *pp = rp->next;
+    if ((rs->count -= rp->count) == 0)
+	dthread_timer_cancel(self, &rs->timer);
+    reply_release(rs, rp);
+    return r;
+}
+
+// send replies buffered by self for target, before a direct send to it
+static int reply_flush_target(dthread_t* self, dthread_t* thr,
+			      ErlDrvTermData target)
+{
+    dthread_replies_t* rs;
+    dreply_t** pp;
+
+    if (!self || !(rs = self->replies) || !rs->count)
+	return 0;
+    pp = reply_find(rs, thr, target);
+    if (*pp == NULL)
+	return 0;
+    return reply_send(self, rs, pp);
+}
+
+static void reply_timeout(dthread_t* self, dthread_timer_t* t, void* arg)
+{
+    (void) t;
+    (void) arg;
+    dthread_reply_flush(self);
+}
+
+//
+// Coalesce replies sent by self with dthread_port_reply_term, up to
+// max replies per target are sent as one list. Buffered replies are
+// also sent when self find its queue empty (dthread_recv) and after
+// at most delay usec (0 = no timer). max <= 1 turns it off. May be
+// called from any thread, self pick up the change on next reply.
+//
+void dthread_reply_coalesce(dthread_t* self, int max, ErlDrvTime delay)
+{
+    self->reply_max = max;
+    self->reply_delay = delay;
+}
+
+// Send all buffered replies (consumer only), return -1 if a send failed
+int dthread_reply_flush(dthread_t* self)
+{
+    dthread_replies_t* rs = self->replies;
+    int i, r = 0;
+
+    if (!rs || !rs->count)
+	return 0;
+    for (i = 0; i < REPLY_HASH; i++) {
+	while(rs->hash[i] != NULL) {
+	    if (reply_send(self, rs, &rs->hash[i]) < 0)
+		r = -1;
+	}
     }
-    dterm_tuple_end(&t, &m);
-    
-    r = dthread_port_send_term(thr, source, target,
-			       dterm_data(&t), dterm_used_size(&t));
-    dterm_finish(&t);
     return r;
 }
 
+// Drop buffered replies, call dthread_reply_flush first to send them
+void dthread_reply_finish(dthread_t* self)
+{
+    dthread_replies_t* rs = self->replies;
+    dreply_t* rp;
+    int i;
 
-static ErlDrvTermData error_atom(int err)
+    if (!rs)
+	return;
+    dthread_timer_cancel(self, &rs->timer);
+    rs->nfree = REPLY_FREE_MAX;  // release all
+    for (i = 0; i < REPLY_HASH; i++) {
+	while((rp = rs->hash[i]) != NULL) {
+	    rs->hash[i] = rp->next;
+	    reply_release(rs, rp);
+	}
+    }
+    while((rp = rs->free) != NULL) {
+	rs->free = rp->next;
+	dterm_finish(&rp->t);
+	DFREE(rp);
+    }
+    DFREE(rs);
+    self->replies = NULL;
+}
+
+//
+// Like dthread_port_send_term but the reply may be held back and sent
+// together with other replies from source to target as a list. Data
+// pointed to by spec is copied.
+//
+int dthread_port_reply_term(dthread_t* thr, dthread_t* source,
+			    ErlDrvTermData target,
+			    ErlDrvTermData* spec, int len)
+{
+    dthread_replies_t* rs = source->replies;
+    ErlDrvTermData* dst;
+    void* data = NULL;
+    dreply_t** pp;
+    dreply_t* rp;
+    int xsz;
+
+    if (source->reply_max <= 1) {
+	dthread_reply_flush(source);  // keep order
+	return dthread_port_send_term(thr, source, target, spec, len);
+    }
+    if ((xsz = dterm_dyn_size(spec, len)) < 0)
+	return -1;
+    if (!rs) {
+	if (!(rs = DZALLOC(sizeof(dthread_replies_t))))
+	    return -1;
+	source->replies = rs;
+    }
+    pp = reply_find(rs, thr, target);
+    if ((rp = *pp) == NULL) {
+	if ((rp = rs->free) != NULL) {
+	    rs->free = rp->next;
+	    rs->nfree--;
+	}
+	else if ((rp = DALLOC(sizeof(dreply_t))) != NULL)
+	    dterm_init(&rp->t);
+	else
+	    return -1;
+	rp->next = NULL;
+	rp->thr = thr;
+	rp->target = target;
+	rp->count = 0;
+	*pp = rp;
+    }
+    // room for the spec, the closing list and the data it points to
+    if (!dterm_need(&rp->t, len+3) ||
+	((xsz > 0) && !(data = dterm_link_alloc_data(&rp->t, xsz)))) {
+	if (rp->count == 0) {  // do not leave an empty reply behind
+	    *pp = rp->next;
+	    reply_release(rs, rp);
+	}
+	return -1;
+    }
+    dst = rp->t.ptr;
+    memcpy(dst, spec, len*sizeof(ErlDrvTermData));
+    rp->t.ptr += len;
+    // copy data and reference binaries
+    dterm_dyn_copy(dst, len, data);
+    rp->count++;
+    if ((rs->count++ == 0) && (source->reply_delay > 0))
+	dthread_timer_start(source, &rs->timer, source->reply_delay,
+			    reply_timeout, NULL);
+    if (rp->count >= source->reply_max)
+	return reply_send(source, rs, pp);
+    return 0;
+}
+
+int dthread_port_reply_dterm(dthread_t* thr, dthread_t* source,
+			     ErlDrvTermData target, dterm_t* p)
+{
+    return dthread_port_reply_term(thr, source, target,
+				   dterm_data(p), dterm_used_size(p));
+}
+
+// send {Ref, ok}
+int dthread_port_send_ok(dthread_t* thr, dthread_t* source, 
+			 ErlDrvTermData target, ErlDrvTermData ref)
+{
+    ErlDrvTermData spec[OK_LEN];
+
+    memcpy(spec, ok_template, sizeof(spec));
+    spec[OK_REF] = ref;
+    return dthread_port_send_term(thr, source, target, spec, OK_LEN);
+}
+
+
+static ErlDrvTermData errno_mk_atom(int err)
 {
     char errstr[256];
     char* s;
@@ -655,7 +4057,14 @@ static ErlDrvTermData error_atom(int err)
     for (s = erl_errno_id(err), t = errstr; *s; s++, t++)
 	*t = tolower(*s);
     *t = '\0';
-    return driver_mk_atom(errstr);
+    return dterm_mk_atom(errstr);  // cached, safe from any thread
+}
+
+static ErlDrvTermData error_atom(int err)
+{
+    if ((err >= 0) && (err < ERRNO_ATOM_MAX))
+	return errno_atom[err];
+    return errno_mk_atom(err);
 }
 
 // send {Ref, {error,Reason}}
@@ -663,25 +4072,19 @@ int dthread_port_send_error(dthread_t* thr, dthread_t* source,
 			    ErlDrvTermData target,
 			    ErlDrvTermData ref, int error)
 {
-    dterm_t t;
-    dterm_mark_t m,e;
-    int r;
+    ErlDrvTermData spec[ERROR_LEN];
 
-    dterm_init(&t);
-    dterm_tuple_begin(&t, &m); {
-	dterm_int(&t, ref);
-	dterm_tuple_begin(&t, &e); {
-	    dterm_atom(&t, am_error);
-	    dterm_atom(&t, error_atom(error));
-	}
-	dterm_tuple_end(&t,&e);
-    }
-    dterm_tuple_end(&t,&m);
-	
-    r = dthread_port_send_term(thr, source, target,
-			       dterm_data(&t), dterm_used_size(&t));
-    dterm_finish(&t);
-    return r;    
+    memcpy(spec, error_template, sizeof(spec));
+    spec[ERROR_REF] = ref;
+    spec[ERROR_REASON] = error_atom(error);
+    return dthread_port_send_term(thr, source, target, spec, ERROR_LEN);
+}
+
+// Select list or binary data for dthread_port_output*, set on the
+// port thread before workers use it
+void dthread_port_output_mode(dthread_t* thr, int mode)
+{
+    thr->output_mode = mode;
 }
 
 //
@@ -697,7 +4100,10 @@ int dthread_port_output(dthread_t* thr, dthread_t* source,
     spec[1] = thr->dport;
     spec[2] = ERL_DRV_ATOM;
     spec[3] = am_data;
-    spec[4] = ERL_DRV_STRING; // ERL_DRV_BUF2BINARY;
+    if (thr->output_mode == DTHREAD_OUTPUT_BINARY)
+	spec[4] = ERL_DRV_BUF2BINARY;
+    else
+	spec[4] = ERL_DRV_STRING;
     spec[5] = (ErlDrvTermData) buf;
     spec[6] = (ErlDrvTermData) len;
     spec[7] = ERL_DRV_TUPLE;
@@ -718,19 +4124,37 @@ int dthread_port_output2(dthread_t* thr, dthread_t* source,
 {
     // generate {Port, {data, Data}}
     int i = 0;
-    ErlDrvTermData spec[16];
+    ErlDrvTermData spec[18];
     
     spec[i++] = ERL_DRV_PORT;
     spec[i++] = thr->dport;
     spec[i++] = ERL_DRV_ATOM;
     spec[i++] = am_data;
-    if (len == 0) {
-	spec[i++] = ERL_DRV_STRING; // ERL_DRV_BUF2BINARY;
+    if (thr->output_mode == DTHREAD_OUTPUT_BINARY) {
+	// Data is a binary or the iolist [Header, Payload]
+	if (hlen) {
+	    spec[i++] = ERL_DRV_BUF2BINARY;
+	    spec[i++] = (ErlDrvTermData) hbuf;
+	    spec[i++] = (ErlDrvTermData) hlen;
+	}
+	if (len || !hlen) {
+	    spec[i++] = ERL_DRV_BUF2BINARY;
+	    spec[i++] = (ErlDrvTermData) buf;
+	    spec[i++] = (ErlDrvTermData) len;
+	}
+	if (hlen && len) {
+	    spec[i++] = ERL_DRV_NIL;
+	    spec[i++] = ERL_DRV_LIST;
+	    spec[i++] = 3;
+	}
+    }
+    else if (len == 0) {
+	spec[i++] = ERL_DRV_STRING;
 	spec[i++] = (ErlDrvTermData) hbuf;
 	spec[i++] = (ErlDrvTermData) hlen;
     }
     else {
-	spec[i++] = ERL_DRV_STRING; // ERL_DRV_BUF2BINARY;
+	spec[i++] = ERL_DRV_STRING;
 	spec[i++] = (ErlDrvTermData) buf;
 	spec[i++] = (ErlDrvTermData) len;
 	if (hlen) {
@@ -748,7 +4172,8 @@ int dthread_port_output2(dthread_t* thr, dthread_t* source,
 }
 
 //
-// Generate output that looks like port data 
+// Generate output that looks like port data, in binary mode the
+// payload is a sub binary of bin (not copied)
 //
 int dthread_port_output_binary(dthread_t* thr, dthread_t* source, 
 			       char* hbuf, ErlDrvSizeT hlen,
@@ -757,21 +4182,38 @@ int dthread_port_output_binary(dthread_t* thr, dthread_t* source,
 {
     // generate {Port, {data, Data}}
     int i = 0;
-    ErlDrvTermData spec[16];
+    ErlDrvTermData spec[19];
     char* buf = bin->orig_bytes + offset;
     
     spec[i++] = ERL_DRV_PORT;
     spec[i++] = thr->dport;
     spec[i++] = ERL_DRV_ATOM;
     spec[i++] = am_data;
-    if (len == 0) {
+    if (thr->output_mode == DTHREAD_OUTPUT_BINARY) {
+	// Data is a binary or the iolist [Header, Payload]
+	if (hlen) {
+	    spec[i++] = ERL_DRV_BUF2BINARY;
+	    spec[i++] = (ErlDrvTermData) hbuf;
+	    spec[i++] = (ErlDrvTermData) hlen;
+	}
+	if (len || !hlen) {
+	    spec[i++] = ERL_DRV_BINARY;
+	    spec[i++] = (ErlDrvTermData) bin;
+	    spec[i++] = (ErlDrvTermData) len;
+	    spec[i++] = (ErlDrvTermData) offset;
+	}
+	if (hlen && len) {
+	    spec[i++] = ERL_DRV_NIL;
+	    spec[i++] = ERL_DRV_LIST;
+	    spec[i++] = 3;
+	}
+    }
+    else if (len == 0) {
 	spec[i++] = ERL_DRV_STRING;
 	spec[i++] = (ErlDrvTermData) hbuf;
 	spec[i++] = (ErlDrvTermData) hlen;
     }
     else {
-	// FIXME select binary|list here!
-        // ERL_DRV_STRING | ERL_DRV_BUF2BINARY;
 	spec[i++] = ERL_DRV_STRING; 
 	spec[i++] = (ErlDrvTermData) buf;
 	spec[i++] = (ErlDrvTermData) len;
@@ -787,5 +4229,3 @@ int dthread_port_output_binary(dthread_t* thr, dthread_t* source,
     spec[i++] = 2;
     return dthread_port_send_term(thr, source, thr->owner, spec, i);
 }
-
-
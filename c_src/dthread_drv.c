@@ -26,20 +26,66 @@
 
 #include <ctype.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <memory.h>
 
 
 #define DTHREAD_OK       0
 #define DTHREAD_ERROR    1
 
+// port_control command 0 is handled by the driver itself (user commands
+// are > 0), the first data byte select the operation
+#define DRV_CTL            0
+#define DRV_CTL_SETOPTS    1   // (Opt:8, Value:32)*
+#define DRV_CTL_CANCEL     2   // (Ref:32) withdraw a request from the caller
+
+#define DRV_OPT_BUDGET     1   // max messages handled per ready_input
+#define DRV_OPT_KEYLEN     2   // route on leading bytes of data (0 = off)
+#define DRV_OPT_QUEUE_LOW  3   // worker queue watermarks (messages)
+#define DRV_OPT_QUEUE_HIGH 4   //   port is busy from high to low
+#define DRV_OPT_QUEUE_LOW_BYTES  5  // worker queue watermarks (bytes)
+#define DRV_OPT_QUEUE_HIGH_BYTES 6
+#define DRV_OPT_MSGQ_LOW   7   // port message queue limits (low > 0)
+#define DRV_OPT_MSGQ_HIGH  8   //   (erl_drv_busy_msgq_limits, high 0 = disable)
+#define DRV_OPT_CMD_PRIO   9   // (Cmd:24, Prio:8) queue lane of a command
+#define DRV_OPT_AGING      10  // serve bulk lane every n:th message (0 = off)
+#define DRV_OPT_REPLY_MAX  11  // reply lists of up to n replies (0 = off)
+#define DRV_OPT_REPLY_DELAY 12 // max usec a reply is held back
+#define DRV_OPT_MODE       13  // worker output data as list (0) or binary (1)
+
+#define DRV_MAX_PRIO_CMD   256 // commands with configurable lane
+
+#define DRV_DEFAULT_BUDGET 32
+
+#define DRV_MON_HASH       64  // buckets of monitored callers
+#define DRV_MON_SWEEP      1000 // ms between drops of idle monitors
+
+// a caller with requests, its queued requests are purged if it dies.
+// The monitor is dropped when no request from its bucket is left.
+typedef struct _drv_mon_t
+{
+    struct _drv_mon_t* next;
+    ErlDrvTermData pid;
+    ErlDrvMonitor  mon;
+} drv_mon_t;
+
 typedef struct _drv_ctx_t
 {
     dthread_t self;             // me
-    dthread_t* other;           // the thread
+    dthread_pool_t* pool;       // the worker thread(s)
+    int budget;                 // max messages per ready_input
+    int busy;                   // port is set busy (worker queue full)
+    uint8_t cmd_prio[DRV_MAX_PRIO_CMD]; // DTHREAD_PRIO_x per command
+    drv_mon_t* mon[DRV_MON_HASH];       // monitored callers
+    int pending[DRV_MON_HASH];  // requests not yet freed per bucket (atomic)
+    int sweep;                  // sweep timer is set
 } drv_ctx_t;
 
 ErlDrvEntry dthread_drv_entry;
 
+DTERM_ATOM(am_data, "data")
+
 #ifdef DEBUG
 #include <stdarg.h>
 
@@ -88,29 +134,25 @@ void* dthread_dispatch(void* arg)
     dterm_init(&tsender);
     
     while(1) {
+	dmessage_t* mp;
 	int r;
 
-	r = dthread_poll(self, NULL, NULL, -1);
-	if (r < 0) {
-	    DEBUGF("dthread_drv: dthread_dispatch select failed=%d", r);
-	    continue;
-	}
-	else if (r == 0) {
-	    DEBUGF("dthread_drv: dthread_dispatch timeout");
+	// own queue first, then steal from the other workers, block
+	// only when there is nothing to do (dthread_pool_send signals
+	// a sleeping worker when another worker has a backlog)
+	if ((mp = dthread_pool_recv(self, NULL)) == NULL) {
+	    r = dthread_poll(self, NULL, NULL, -1);
+	    if (r < 0)
+		DEBUGF("dthread_drv: dthread_dispatch select failed=%d", r);
+	    else if (r == 0)
+		DEBUGF("dthread_drv: dthread_dispatch timeout");
 	    continue;
 	}
 	else {
-	    dmessage_t* mp;
-
-	    DEBUGF("dthread_drv: dthread_dispatch r=%d", r);
-	    if ((mp = dthread_recv(self, NULL)) == NULL) {
-		DEBUGF("dthread_drv: message was NULL");
-		continue;
-	    }
-
 	    switch(mp->cmd) {
 	    case DTHREAD_STOP:
 		DEBUGF("dthread_drv: dthread_dispatch STOP");
+		dthread_reply_flush(self);
 		dmessage_free(mp);
 		dterm_finish(&tsender);
 		dthread_exit(0);
@@ -126,24 +168,29 @@ void* dthread_dispatch(void* arg)
 		break;
 
 	    case 2: {
+		// build the reply in the message, no copy when handed over
+		dmessage_t* rp;
+		dterm_t* t;
 		DEBUGF("dthread_drv: dthread_dispatch cmd=2");
-		dterm_put2(&tsender, ERL_DRV_PORT, self->dport);
-		dterm_put2(&tsender, ERL_DRV_ATOM, driver_mk_atom("data"));
-		dterm_put3(&tsender, ERL_DRV_STRING,
+		if (!(rp = dmessage_create_term(0)))
+		    break;
+		t = dmessage_term(rp);
+		dterm_put2(t, ERL_DRV_PORT, self->dport);
+		dterm_put2(t, ERL_DRV_ATOM, DTERM_ATOM_VALUE(am_data));
+		dterm_put3(t, ERL_DRV_STRING,
 			   (ErlDrvTermData) "NEW WORLD", (ErlDrvTermData) 9);
-		dterm_put2(&tsender, ERL_DRV_TUPLE, 2);
-		dterm_put2(&tsender, ERL_DRV_TUPLE, 2);
+		dterm_put2(t, ERL_DRV_TUPLE, 2);
+		dterm_put2(t, ERL_DRV_TUPLE, 2);
 
-		dthread_port_send_dterm(mp->source, self, mp->from, &tsender);
-		dterm_reset(&tsender);
+		dthread_port_send_dmessage(mp->source, self, mp->from, rp);
 		break;
 	    }
 
 	    case 3: {
 		DEBUGF("dthread_drv: dthread_dispatch cmd=3");
-		dterm_put2(&tsender, ERL_DRV_ATOM, driver_mk_atom("x"));
-		dterm_put2(&tsender, ERL_DRV_ATOM, driver_mk_atom("y"));
-		dterm_put2(&tsender, ERL_DRV_ATOM, driver_mk_atom("z"));
+		dterm_atom_cstr(&tsender, "x");
+		dterm_atom_cstr(&tsender, "y");
+		dterm_atom_cstr(&tsender, "z");
 		dterm_put2(&tsender, ERL_DRV_TUPLE, 3);
 		dthread_port_output_dterm(mp->source, self, &tsender);
 		dterm_reset(&tsender);
@@ -162,7 +209,7 @@ void* dthread_dispatch(void* arg)
 		    dterm_put2(&tsender, ERL_DRV_UINT, value + 1);
 		    dterm_put2(&tsender, ERL_DRV_TUPLE, 2);
 		    
-		    dthread_port_send_dterm(mp->source,self,mp->from,&tsender);
+		    dthread_port_reply_dterm(mp->source,self,mp->from,&tsender);
 		    dterm_reset(&tsender);
 		}
 		break;
@@ -195,18 +242,50 @@ static void dthread_drv_finish(void)
     dthread_lib_finish();
 }
 
+static unsigned int drv_mon_hash(ErlDrvTermData pid)
+{
+    return dthread_key_hash((char*) &pid, sizeof(pid)) % DRV_MON_HASH;
+}
+
+static void drv_uncount(drv_ctx_t* ctx, ErlDrvTermData pid)
+{
+    __atomic_sub_fetch(&ctx->pending[drv_mon_hash(pid)], 1, __ATOMIC_RELAXED);
+}
+
+// a request from the port is freed (on any thread), self is the
+// first member of drv_ctx_t
+static void drv_request_done(dthread_t* source, dmessage_t* mp)
+{
+    drv_uncount((drv_ctx_t*) source, mp->from);
+}
+
+// command is "dthread_drv [Workers]"
 static ErlDrvData dthread_drv_start(ErlDrvPort port, char* command)
 {
-    (void) command;
     drv_ctx_t* ctx;
+    char* ptr;
+    int n = 1;
 
     DEBUGF("dthread_drv: start");
 
-    ctx = DALLOC(sizeof(drv_ctx_t));
-    
-    dthread_init(&ctx->self, port);
+    if ((ptr = strchr(command, ' ')) && ((n = atoi(ptr+1)) <= 0))
+	return ERL_DRV_ERROR_BADARG;
 
-    ctx->other = dthread_start(port, dthread_dispatch, ctx, 4096);
+    if ((ctx = DZALLOC(sizeof(drv_ctx_t))) == NULL)
+	return ERL_DRV_ERROR_GENERAL;
+
+    dthread_init(&ctx->self, port);
+    ctx->self.req_done = drv_request_done;
+    ctx->budget = DRV_DEFAULT_BUDGET;
+    memset(ctx->cmd_prio, DTHREAD_PRIO_NORMAL, sizeof(ctx->cmd_prio));
+    memset(ctx->mon, 0, sizeof(ctx->mon));
+
+    ctx->pool = dthread_pool_start(port, n, dthread_dispatch, ctx, 4096);
+    if (!ctx->pool) {
+	dthread_finish(&ctx->self);
+	DFREE(ctx);
+	return ERL_DRV_ERROR_GENERAL;
+    }
 
     dthread_signal_use(&ctx->self, 1);
     dthread_signal_select(&ctx->self, 1);
@@ -220,11 +299,22 @@ static ErlDrvData dthread_drv_start(ErlDrvPort port, char* command)
 static void dthread_drv_stop(ErlDrvData d)
 {
     drv_ctx_t* ctx = (drv_ctx_t*) d;
-    void* value;
+    int i;
 
     DEBUGF("dthread_drv: stop");
 
-    dthread_stop(ctx->other, &ctx->self, &value);
+    dthread_pool_stop(ctx->pool, &ctx->self);
+
+    if (ctx->sweep)
+	driver_cancel_timer(ctx->self.port);
+    for (i = 0; i < DRV_MON_HASH; i++) {
+	drv_mon_t* m;
+	while((m = ctx->mon[i]) != NULL) {
+	    ctx->mon[i] = m->next;
+	    driver_demonitor_process(ctx->self.port, &m->mon);
+	    DFREE(m);
+	}
+    }
 
     dthread_signal_use(&ctx->self, 0);
 
@@ -232,6 +322,206 @@ static void dthread_drv_stop(ErlDrvData d)
     DFREE(ctx);
 }
 
+// set one watermark on all worker queues
+static void drv_queue_limit(drv_ctx_t* ctx, int opt, uint32_t value)
+{
+    int i;
+
+    for (i = 0; i < ctx->pool->n; i++) {
+	dthread_t* thr = ctx->pool->thr[i];
+	int low_len = thr->iq_low_len;
+	int high_len = thr->iq_high_len;
+	size_t low_bytes = thr->iq_low_bytes;
+	size_t high_bytes = thr->iq_high_bytes;
+
+	switch(opt) {
+	case DRV_OPT_QUEUE_LOW: low_len = value; break;
+	case DRV_OPT_QUEUE_HIGH: high_len = value; break;
+	case DRV_OPT_QUEUE_LOW_BYTES: low_bytes = value; break;
+	case DRV_OPT_QUEUE_HIGH_BYTES: high_bytes = value; break;
+	default: break;
+	}
+	dthread_queue_limits(thr, low_len, high_len, low_bytes, high_bytes);
+    }
+}
+
+// set port busy when a worker queue reach its high watermark, it is
+// cleared when all worker queues are back at low (DTHREAD_QUEUE_LOW)
+static void drv_check_busy(drv_ctx_t* ctx)
+{
+    int busy = dthread_pool_busy(ctx->pool);
+
+    if (busy != ctx->busy) {
+	DEBUGF("dthread_drv: busy=%d", busy);
+	set_busy_port(ctx->self.port, busy);
+	ctx->busy = busy;
+    }
+}
+
+static drv_mon_t** drv_mon_find(drv_ctx_t* ctx, ErlDrvTermData pid)
+{
+    drv_mon_t** pp = &ctx->mon[drv_mon_hash(pid)];
+
+    while(*pp && ((*pp)->pid != pid))
+	pp = &(*pp)->next;
+    return pp;
+}
+
+// monitor the caller, once, so its queued requests can be purged,
+// and count the request it is about to send
+static void drv_monitor(drv_ctx_t* ctx, ErlDrvTermData pid)
+{
+    drv_mon_t** pp = drv_mon_find(ctx, pid);
+    drv_mon_t* m;
+
+    __atomic_add_fetch(&ctx->pending[drv_mon_hash(pid)], 1, __ATOMIC_RELAXED);
+    if (*pp || !(m = DALLOC(sizeof(drv_mon_t))))
+	return;
+    if (driver_monitor_process(ctx->self.port, pid, &m->mon) != 0) {
+	DFREE(m);
+	return;
+    }
+    m->pid = pid;
+    m->next = NULL;
+    *pp = m;
+    if (!ctx->sweep) {
+	driver_set_timer(ctx->self.port, DRV_MON_SWEEP);
+	ctx->sweep = 1;
+    }
+}
+
+// drop the monitors in buckets without requests, keep the timer
+// while monitors are left
+static void drv_mon_sweep(drv_ctx_t* ctx)
+{
+    int i, left = 0;
+
+    for (i = 0; i < DRV_MON_HASH; i++) {
+	drv_mon_t* m;
+	if (__atomic_load_n(&ctx->pending[i], __ATOMIC_RELAXED) > 0) {
+	    left += (ctx->mon[i] != NULL);
+	    continue;
+	}
+	while((m = ctx->mon[i]) != NULL) {
+	    ctx->mon[i] = m->next;
+	    driver_demonitor_process(ctx->self.port, &m->mon);
+	    DFREE(m);
+	}
+    }
+    if ((ctx->sweep = (left > 0)))
+	driver_set_timer(ctx->self.port, DRV_MON_SWEEP);
+}
+
+static int drv_setopts(drv_ctx_t* ctx, uint8_t* ptr, ErlDrvSizeT len)
+{
+    while(len >= 5) {
+	uint32_t value = (ptr[1]<<24) | (ptr[2]<<16) | (ptr[3]<<8) | ptr[4];
+	switch(ptr[0]) {
+	case DRV_OPT_BUDGET:
+	    if ((value == 0) || (value > INT32_MAX))
+		return -1;
+	    ctx->budget = (int) value;
+	    break;
+	case DRV_OPT_KEYLEN:
+	    if (value > INT32_MAX)
+		return -1;
+	    ctx->pool->keylen = (int) value;
+	    break;
+	case DRV_OPT_QUEUE_LOW:
+	case DRV_OPT_QUEUE_HIGH:
+	    if (value > INT32_MAX)
+		return -1;
+	    drv_queue_limit(ctx, ptr[0], value);
+	    break;
+	case DRV_OPT_QUEUE_LOW_BYTES:
+	case DRV_OPT_QUEUE_HIGH_BYTES:
+	    drv_queue_limit(ctx, ptr[0], value);
+	    break;
+	case DRV_OPT_CMD_PRIO:
+	    if (((value >> 8) >= DRV_MAX_PRIO_CMD) ||
+		((value & 0xff) >= DTHREAD_NUM_PRIO))
+		return -1;
+	    ctx->cmd_prio[value >> 8] = value & 0xff;
+	    break;
+	case DRV_OPT_AGING: {
+	    int i;
+	    if (value > INT32_MAX)
+		return -1;
+	    for (i = 0; i < ctx->pool->n; i++)
+		dthread_queue_aging(ctx->pool->thr[i], (int) value);
+	    break;
+	}
+	case DRV_OPT_REPLY_MAX:
+	case DRV_OPT_REPLY_DELAY: {
+	    int i;
+	    if (value > INT32_MAX)
+		return -1;
+	    for (i = 0; i < ctx->pool->n; i++) {
+		dthread_t* thr = ctx->pool->thr[i];
+		if (ptr[0] == DRV_OPT_REPLY_MAX)
+		    dthread_reply_coalesce(thr, (int) value, thr->reply_delay);
+		else
+		    dthread_reply_coalesce(thr, thr->reply_max, value);
+	    }
+	    break;
+	}
+	case DRV_OPT_MODE:
+	    if (value > DTHREAD_OUTPUT_BINARY)
+		return -1;
+	    dthread_port_output_mode(&ctx->self, (int) value);
+	    break;
+	case DRV_OPT_MSGQ_LOW:
+	case DRV_OPT_MSGQ_HIGH: {
+	    ErlDrvSizeT lim = value ? (ErlDrvSizeT) value :
+		ERL_DRV_BUSY_MSGQ_DISABLED;
+	    ErlDrvSizeT keep = ERL_DRV_BUSY_MSGQ_READ_ONLY;
+	    if (ptr[0] == DRV_OPT_MSGQ_LOW) {
+		// only the high limit disables, low must be a limit
+		if (value == 0)
+		    return -1;
+		erl_drv_busy_msgq_limits(ctx->self.port, &lim, &keep);
+	    }
+	    else
+		erl_drv_busy_msgq_limits(ctx->self.port, &keep, &lim);
+	    break;
+	}
+	default:
+	    return -1;
+	}
+	ptr += 5;
+	len -= 5;
+    }
+    return (len == 0) ? 0 : -1;
+}
+
+// driver control, not sent to the thread
+static ErlDrvSSizeT drv_ctl(drv_ctx_t* ctx, char* buf, ErlDrvSizeT len,
+			    char** rbuf, ErlDrvSizeT rsize)
+{
+    if (len < 1)
+	return ctl_reply(DTHREAD_ERROR, "badarg", 6, rbuf, rsize);
+    switch(buf[0]) {
+    case DRV_CTL_SETOPTS:
+	if (drv_setopts(ctx, (uint8_t*) buf+1, len-1) < 0)
+	    return ctl_reply(DTHREAD_ERROR, "badarg", 6, rbuf, rsize);
+	return ctl_reply(DTHREAD_OK, "", 0, rbuf, rsize);
+    case DRV_CTL_CANCEL: {
+	uint8_t* ptr = (uint8_t*) buf+1;
+	uint32_t ref;
+	if (len != 5)
+	    return ctl_reply(DTHREAD_ERROR, "badarg", 6, rbuf, rsize);
+	ref = (ptr[0]<<24) | (ptr[1]<<16) | (ptr[2]<<8) | ptr[3];
+	// only the caller that sent the request may withdraw it
+	dthread_pool_cancel(ctx->pool, &ctx->self, (ErlDrvTermData) ref,
+			    driver_caller(ctx->self.port));
+	drv_check_busy(ctx);
+	return ctl_reply(DTHREAD_OK, "", 0, rbuf, rsize);
+    }
+    default:
+	return ctl_reply(DTHREAD_ERROR, "badarg", 6, rbuf, rsize);
+    }
+}
+
 static ErlDrvSSizeT dthread_drv_control(ErlDrvData d, unsigned int cmd,
 					char* buf, ErlDrvSizeT len,
 					char** rbuf, ErlDrvSizeT rsize)
@@ -242,8 +532,27 @@ static ErlDrvSSizeT dthread_drv_control(ErlDrvData d, unsigned int cmd,
 
     DEBUGF("dthread_drv: ctl: cmd=%u, len=%d", cmd, len);
 
+    if (cmd == DRV_CTL)
+	return drv_ctl(ctx, buf, len, rbuf, rsize);
+
     ctx->self.caller = driver_caller(ctx->self.port);
-    dthread_control(ctx->other, &ctx->self, cmd, buf, len);
+    drv_monitor(ctx, ctx->self.caller);
+    if ((cmd < DRV_MAX_PRIO_CMD) &&
+	(ctx->cmd_prio[cmd] != DTHREAD_PRIO_NORMAL)) {
+	dmessage_t* mp;
+	if ((mp = dmessage_create(cmd, buf, len))) {
+	    mp->flags |= DMESSAGE_REQUEST;
+	    mp->from = ctx->self.caller;
+	    mp->ref  = ++ctx->self.ref;
+	    dmessage_set_prio(mp, ctx->cmd_prio[cmd]);
+	    dthread_pool_send(ctx->pool, &ctx->self, mp);
+	}
+	else  // not sent
+	    drv_uncount(ctx, ctx->self.caller);
+    }
+    else
+	dthread_pool_control(ctx->pool, &ctx->self, cmd, buf, len);
+    drv_check_busy(ctx);
 
     r = (uint32_t) ctx->self.ref;
     ref_buf[0] = r >> 24;
@@ -260,14 +569,29 @@ static void dthread_drv_output(ErlDrvData d, char* buf, ErlDrvSizeT len)
     DEBUGF("dthread_drv: output");
 
     ctx->self.caller = driver_caller(ctx->self.port);
-    dthread_output(ctx->other, &ctx->self, buf, len);
+    drv_monitor(ctx, ctx->self.caller);
+    dthread_pool_output(ctx->pool, &ctx->self, buf, len);
+    drv_check_busy(ctx);
+}
+
+static void dthread_drv_outputv(ErlDrvData d, ErlIOVec* ev)
+{
+    drv_ctx_t*   ctx = (drv_ctx_t*) d;
+
+    DEBUGF("dthread_drv: outputv");
+
+    ctx->self.caller = driver_caller(ctx->self.port);
+    drv_monitor(ctx, ctx->self.caller);
+    dthread_pool_outputv(ctx->pool, &ctx->self, ev);
+    drv_check_busy(ctx);
 }
 
 static void dthread_drv_timeout(ErlDrvData d)
 {
-    (void) d;
-    // drv_ctx_t* ctx = (drv_ctx_t*) d;
-    DEBUGF("dthread_drv: output");
+    drv_ctx_t* ctx = (drv_ctx_t*) d;
+
+    DEBUGF("dthread_drv: timeout");
+    drv_mon_sweep(ctx);
 }
 
 static void dthread_drv_ready_input(ErlDrvData d, ErlDrvEvent e)
@@ -276,44 +600,74 @@ static void dthread_drv_ready_input(ErlDrvData d, ErlDrvEvent e)
 
     if (ctx->self.iq_signal[0] == e) { // got input !
 	dmessage_t* mp;
+	int n;
 
 	DEBUGF("dthread_drv: ready_input handle=%d", 
 	       DTHREAD_EVENT(ctx->self.iq_signal[0]));
 
-	if (!(mp = dthread_recv(&ctx->self, NULL))) {
-	    DEBUGF("dthread_drv: ready_input signaled with no event! handle=%d",
-		   DTHREAD_EVENT(ctx->self.iq_signal[0]));
-	    return;
-	}
+	// handle up to budget messages, if more remain the signal is
+	// still set and we are called again
+	for (n = 0; n < ctx->budget; n++) {
+	    if (!(mp = dthread_recv(&ctx->self, NULL))) {
+		if (n == 0)
+		    DEBUGF("dthread_drv: ready_input signaled with no event! "
+			   "handle=%d", DTHREAD_EVENT(ctx->self.iq_signal[0]));
+		return;
+	    }
 
-	switch(mp->cmd) {
-	case DTHREAD_OUTPUT_TERM:
-	    DEBUGF("dthread_drv: ready_input (OUTPUT_TERM)");
-	    DOUTPUT_TERM(&ctx->self, (ErlDrvTermData*) mp->buffer,
-			 mp->used / sizeof(ErlDrvTermData));
-	    break;
-	case DTHREAD_SEND_TERM:
-	    DEBUGF("dthread_drv: ready_input (SEND_TERM)");
-	    DSEND_TERM(&ctx->self, mp->to, /* orignal from ! */
-		       (ErlDrvTermData*) mp->buffer,
-		       mp->used / sizeof(ErlDrvTermData)); 
-	    break;
-	case DTHREAD_OUTPUT:
-	    DEBUGF("dthread_drv: ready_input (OUTPUT)");
-	    driver_output(ctx->self.port, mp->buffer, mp->used);
-	    break;
-	default:
-	    DEBUGF("dthread_drv: read_input cmd=%d not matched",
-		   mp->cmd);
-	    break;
+	    switch(mp->cmd) {
+	    case DTHREAD_OUTPUT_TERM:
+		DEBUGF("dthread_drv: ready_input (OUTPUT_TERM)");
+		DOUTPUT_TERM(&ctx->self, (ErlDrvTermData*) mp->buffer,
+			     mp->used / sizeof(ErlDrvTermData));
+		break;
+	    case DTHREAD_SEND_TERM:
+		DEBUGF("dthread_drv: ready_input (SEND_TERM)");
+		DSEND_TERM(&ctx->self, mp->to, /* orignal from ! */
+			   (ErlDrvTermData*) mp->buffer,
+			   mp->used / sizeof(ErlDrvTermData)); 
+		break;
+	    case DTHREAD_OUTPUT:
+		DEBUGF("dthread_drv: ready_input (OUTPUT)");
+		driver_output(ctx->self.port, mp->buffer, mp->used);
+		break;
+	    case DTHREAD_QUEUE_LOW:
+		DEBUGF("dthread_drv: ready_input (QUEUE_LOW)");
+		drv_check_busy(ctx);
+		break;
+	    default:
+		DEBUGF("dthread_drv: read_input cmd=%d not matched",
+		       mp->cmd);
+		break;
+	    }
+	    dmessage_free(mp);
 	}
-	dmessage_free(mp);
     }
     else {
 	DEBUGF("dthread_drv: ready_input (NO MATCH)");
     }
 }
 
+// a caller died, drop its queued requests
+static void dthread_drv_process_exit(ErlDrvData d, ErlDrvMonitor* monitor)
+{
+    drv_ctx_t* ctx = (drv_ctx_t*) d;
+    ErlDrvTermData pid = driver_get_monitored_process(ctx->self.port,
+						      monitor);
+    drv_mon_t** pp = drv_mon_find(ctx, pid);
+    drv_mon_t* m;
+    int n;
+
+    if ((m = *pp) != NULL) {
+	*pp = m->next;
+	DFREE(m);
+    }
+    n = dthread_pool_purge(ctx->pool, &ctx->self, pid);
+    DEBUGF("dthread_drv: process_exit purged=%d", n);
+    (void) n;
+    drv_check_busy(ctx);
+}
+
 static void dthread_drv_ready_output(ErlDrvData d, ErlDrvEvent e)
 {
     (void) d;
@@ -342,6 +696,7 @@ DRIVER_INIT(dthread_drv)
     ptr->start = dthread_drv_start;
     ptr->stop  = dthread_drv_stop;
     ptr->output = dthread_drv_output;
+    ptr->outputv = dthread_drv_outputv;
     ptr->ready_input  = dthread_drv_ready_input;
     ptr->ready_output = dthread_drv_ready_output;
     ptr->finish = dthread_drv_finish;
@@ -352,7 +707,7 @@ DRIVER_INIT(dthread_drv)
     ptr->major_version = ERL_DRV_EXTENDED_MAJOR_VERSION;
     ptr->minor_version = ERL_DRV_EXTENDED_MINOR_VERSION;
     ptr->driver_flags = ERL_DRV_FLAG_USE_PORT_LOCKING;
-    ptr->process_exit = 0;
+    ptr->process_exit = dthread_drv_process_exit;
     ptr->stop_select = dthread_drv_stop_select;
     return ptr;
 }
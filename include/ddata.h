@@ -21,12 +21,19 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#ifndef __WIN32__
+#include <sys/uio.h>
+#endif
 
 #include "dlib.h"
 
+struct _ddata_rope_t;
+
 typedef struct _ddata_t
 {
     int dyn_alloc;
+    struct _ddata_rope_t* rope; /* segmented (rope) mode, write only */
     uint8_t* base;       /* base pointer */
     uint8_t* rd;         /* read pointer */
     uint8_t* wr;         /* write pointer */
@@ -34,6 +41,39 @@ typedef struct _ddata_t
     uint8_t  buf[1];     /* used in some dynamic cases */
 } ddata_t;
 
+/*
+ * Segmented ddata (rope). Encoded data is written in chunks, when a
+ * chunk is full the data written so far becomes a segment and a new
+ * chunk is started, nothing is copied. Large binaries may be added
+ * as segments by reference. The segments are written with writev
+ * (ddata_rope_writev/ddata_rope_send) or passed in an ErlIOVec to
+ * driver_outputv (ddata_rope_erliov). Chunks are ErlDrvBinary's in
+ * drivers so they may be referenced from an ErlIOVec.
+ */
+#define DDATA_ROPE_CHUNK   4096  /* default chunk size */
+#define DDATA_ROPE_REF_MIN 512   /* ddata_put_binary_ref copy below this */
+#define DDATA_ROPE_IOV     64    /* iovec's per writev call */
+
+typedef struct _ddata_seg_t
+{
+    struct _ddata_seg_t* next;
+    uint8_t* ptr;               /* segment data */
+    size_t   len;               /* segment length */
+    void*    chunk;             /* referenced chunk (or ErlDrvBinary) */
+    void   (*release)(void*);   /* release external data (if not NULL) */
+    void*    arg;               /* release argument */
+} ddata_seg_t;
+
+typedef struct _ddata_rope_t
+{
+    ddata_seg_t*  first;        /* segments */
+    ddata_seg_t** last;         /* append point */
+    int           nseg;         /* number of segments */
+    size_t        len;          /* bytes in segments */
+    size_t        chunk_size;
+    void*         chunk;        /* chunk being written (base..eob) */
+} ddata_rope_t;
+
 static void ddata_init(ddata_t* data, uint8_t* buf, uint32_t len, 
 		       int dynamic) __attribute__((unused));
 static void ddata_r_init(ddata_t* data, uint8_t* buf, uint32_t len, 
@@ -55,6 +95,32 @@ static inline void ddata_forward(ddata_t* data, uint32_t len) __attribute__((unu
 static inline void ddata_backward(ddata_t* data, uint32_t len) __attribute__((unused));
 static void ddata_send(ddata_t* data, int fd) __attribute__((unused));
 
+static int ddata_rope_init(ddata_t* data, ddata_rope_t* rope,
+			   size_t chunk_size) __attribute__((unused));
+static void ddata_rope_final(ddata_t* data) __attribute__((unused));
+static void ddata_rope_drop(ddata_rope_t* rope) __attribute__((unused));
+static int ddata_rope_next(ddata_t* data, size_t need) __attribute__((unused));
+static int ddata_rope_flush(ddata_t* data) __attribute__((unused));
+static size_t ddata_rope_size(ddata_t* data) __attribute__((unused));
+static int ddata_rope_add_ref(ddata_t* data, uint8_t* ptr, size_t len,
+			      void (*release)(void*), void* arg) __attribute__((unused));
+#ifndef __WIN32__
+static int ddata_rope_iov(ddata_t* data, struct iovec* iov, int max) __attribute__((unused));
+static void ddata_rope_consume(ddata_rope_t* rope, size_t len) __attribute__((unused));
+static ssize_t ddata_rope_writev(ddata_t* data, int fd) __attribute__((unused));
+static ssize_t ddata_rope_send(ddata_t* data, int fd) __attribute__((unused));
+#endif
+static void ddata_put_binary_ref(ddata_t* data, uint8_t* buf, uint32_t len,
+				 void (*release)(void*), void* arg) __attribute__((unused));
+#ifndef NO_ERL_DRIVER
+static int ddata_rope_add_binary(ddata_t* data, ErlDrvBinary* bin,
+				 size_t offset, size_t len) __attribute__((unused));
+static void ddata_put_drv_binary(ddata_t* data, ErlDrvBinary* bin,
+				 size_t offset, uint32_t len) __attribute__((unused));
+static int ddata_rope_erliov(ddata_t* data, ErlIOVec* ev, SysIOVec* iov,
+			     ErlDrvBinary** binv, int max) __attribute__((unused));
+#endif
+
 #define BOOLEAN        0  /* uint8_t */
 #define UINT8          1  /* uint8_t */
 #define UINT16         2  /* uint16_t */
@@ -74,71 +140,93 @@ static void ddata_send(ddata_t* data, int fd) __attribute__((unused));
 #define FLOAT32        16
 #define FLOAT64        17
 #define STRING4        18 /* 4-byte len followed by UTF-8 string  */
+#define ARRAY          19 /* element tag, 4-byte count, big endian elements */
+
+/* Integers are big endian on the wire, loads and stores are unaligned */
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define DDATA_BIG_ENDIAN 1
+#define DDATA_BE16(x) ((uint16_t)(x))
+#define DDATA_BE32(x) ((uint32_t)(x))
+#define DDATA_BE64(x) ((uint64_t)(x))
+#else
+#define DDATA_BE16(x) __builtin_bswap16((uint16_t)(x))
+#define DDATA_BE32(x) __builtin_bswap32((uint32_t)(x))
+#define DDATA_BE64(x) __builtin_bswap64((uint64_t)(x))
+#endif
 
-#define DDATA_PUT_UINT8(ptr, n) do { \
-	((uint8_t*)(ptr))[0] = ((n) & 0xff); \
-    } while(0)
-
-#define DDATA_GET_UINT8(ptr) \
-    (((uint8_t*)(ptr))[0])
+static inline uint16_t ddata_load16(const void* ptr)
+{
+    uint16_t v;
+    memcpy(&v, ptr, sizeof(v));
+    return DDATA_BE16(v);
+}
 
-#define DDATA_PUT_UINT16(ptr, n) do { \
-	((uint8_t*)(ptr))[0] = (((n) >> 8) & 0xff);	\
-	((uint8_t*)(ptr))[1] = ((n) & 0xff);		\
-    } while(0)
+static inline uint32_t ddata_load32(const void* ptr)
+{
+    uint32_t v;
+    memcpy(&v, ptr, sizeof(v));
+    return DDATA_BE32(v);
+}
 
-#define DDATA_GET_UINT16(ptr) \
-    ((((uint8_t*)(ptr))[0] << 8) + ((uint8_t*)(ptr))[1])
+static inline uint64_t ddata_load64(const void* ptr)
+{
+    uint64_t v;
+    memcpy(&v, ptr, sizeof(v));
+    return DDATA_BE64(v);
+}
 
-#define DDATA_PUT_UINT32(ptr, n) do { \
-	((uint8_t*)(ptr))[0] = (((n) >> 24) & 0xff);		\
-	((uint8_t*)(ptr))[1] = (((n) >> 16) & 0xff);		\
-	((uint8_t*)(ptr))[2] = (((n) >> 8) & 0xff);		\
-	((uint8_t*)(ptr))[3] = ((n) & 0xff);			\
-    } while(0)
+static inline void ddata_store16(void* ptr, uint16_t n)
+{
+    n = DDATA_BE16(n);
+    memcpy(ptr, &n, sizeof(n));
+}
 
-#define DDATA_GET_UINT32(ptr) \
-    ((((uint8_t*)(ptr))[0] << 24) + (((uint8_t*)(ptr))[1] << 16) +	\
-     (((uint8_t*)(ptr))[2] << 8) + ((uint8_t*)(ptr))[3])
+static inline void ddata_store32(void* ptr, uint32_t n)
+{
+    n = DDATA_BE32(n);
+    memcpy(ptr, &n, sizeof(n));
+}
 
-#define DDATA_GET_UINT64(ptr) \
-    ((((uint64_t)DDATA_GET_UINT32(ptr)) << 32) | \
-     DDATA_GET_UINT32(ptr+4))
+static inline void ddata_store64(void* ptr, uint64_t n)
+{
+    n = DDATA_BE64(n);
+    memcpy(ptr, &n, sizeof(n));
+}
 
-#ifndef _QUAD_HIGHWORD
-#define _QUAD_HIGHWORD 1
-#endif
+#define DDATA_PUT_UINT8(ptr, n) do { \
+	((uint8_t*)(ptr))[0] = ((n) & 0xff); \
+    } while(0)
 
-#ifndef _QUAD_LOWWORD
-#define _QUAD_LOWWORD 0
-#endif
+#define DDATA_GET_UINT8(ptr) \
+    (((uint8_t*)(ptr))[0])
 
-#define DDATA_PUT_UINT64(ptr, n) do { \
-	union { uint64_t u64; uint32_t u32[2]; } iu; \
-	uint32_t n32;                                 \
-	iu.u64 = (n);                                  \
-	n32=iu.u32[_QUAD_HIGHWORD]; DDATA_PUT_UINT32((ptr), n32);  \
-	n32=iu.u32[_QUAD_LOWWORD]; DDATA_PUT_UINT32((ptr)+4, n32); \
-    } while(0)
+#define DDATA_PUT_UINT16(ptr, n) ddata_store16((ptr), (uint16_t)(n))
+#define DDATA_GET_UINT16(ptr)    ddata_load16((ptr))
+#define DDATA_PUT_UINT32(ptr, n) ddata_store32((ptr), (uint32_t)(n))
+#define DDATA_GET_UINT32(ptr)    ddata_load32((ptr))
+#define DDATA_PUT_UINT64(ptr, n) ddata_store64((ptr), (uint64_t)(n))
+#define DDATA_GET_UINT64(ptr)    ddata_load64((ptr))
 
 #define DDATA_PUT_FLOAT32(ptr, n) do { \
-	union { float f32; uint32_t u32; } fu;   \
-	uint32_t n32;                            \
-	fu.f32 = (n);                             \
-	n32=fu.f32; DDATA_PUT_UINT32((ptr), n32);       \
+	union { float f32; uint32_t u32; } fu;	\
+	fu.f32 = (n);				\
+	ddata_store32((ptr), fu.u32);		\
     } while(0)
 
 #define DDATA_PUT_FLOAT64(ptr, n) do { \
-	union { double f64; uint32_t u32[2]; } fu;       \
-	uint32_t n32;                                     \
-	fu.f64 = (n);                                   \
-	n32=fu.u32[_QUAD_HIGHWORD]; DDATA_PUT_UINT32((ptr), n32);  \
-	n32=fu.u32[_QUAD_LOWWORD]; DDATA_PUT_UINT32((ptr)+4, n32); \
+	union { double f64; uint64_t u64; } fu;	\
+	fu.f64 = (n);				\
+	ddata_store64((ptr), fu.u64);		\
     } while(0)
 
 
 static void ddata_reset(ddata_t* data) 
 {
+    if (data->rope) {  /* segment data may still be referenced */
+	ddata_rope_drop(data->rope);
+	data->rd = data->wr;
+	return;
+    }
     data->wr = data->base;
     data->rd = data->wr;
 }
@@ -146,6 +234,7 @@ static void ddata_reset(ddata_t* data)
 static void ddata_init(ddata_t* data, uint8_t* buf, uint32_t len, int dynamic)
 {
     data->dyn_alloc = dynamic;
+    data->rope = NULL;
     data->base = buf;
     data->rd   = data->base;
     data->wr   = data->base;
@@ -155,6 +244,7 @@ static void ddata_init(ddata_t* data, uint8_t* buf, uint32_t len, int dynamic)
 static void ddata_r_init(ddata_t* data, uint8_t* buf, uint32_t len, int dynamic)
 {
     data->dyn_alloc = dynamic;
+    data->rope = NULL;
     data->base = buf;
     data->rd   = data->base;
     data->wr   = data->base + len;
@@ -167,6 +257,7 @@ static ddata_t* ddata_new(uint8_t* buf, uint32_t len)
     if (data == NULL)
 	return NULL;
     data->dyn_alloc = 0;    /* dyn_alloc=1 only when buffer is separate! */
+    data->rope = NULL;
     data->base = data->buf;
     data->rd   = data->base;
     data->wr   = data->base;
@@ -180,6 +271,10 @@ static ddata_t* ddata_new(uint8_t* buf, uint32_t len)
 
 static void ddata_final(ddata_t* data)
 {
+    if (data->rope) {
+	ddata_rope_final(data);
+	return;
+    }
     if (data->dyn_alloc && (data->base != NULL)) {
 	DFREE(data->base);
 	data->base = NULL;
@@ -196,6 +291,8 @@ static int ddata_compact(ddata_t* data)
 {
     size_t used, roffs, woffs;
 
+    if (data->rope)  /* base..rd may belong to segments */
+	return 0;
     roffs = data->rd - data->base;
     woffs = data->wr - data->base;
     used  = woffs-roffs;
@@ -215,6 +312,8 @@ static int ddata_realloc(ddata_t* data, size_t need)
 
     if (wavail >= need)
 	return 0;
+    if (data->rope)  /* new chunk, no copy */
+	return ddata_rope_next(data, need);
     if (need < 256)
 	need += 256;
     old_size = data->eob - data->base;
@@ -283,8 +382,9 @@ static inline void ddata_forward(ddata_t* data, uint32_t len)
 static inline void ddata_backward(ddata_t* data, uint32_t len)
 {
     uint8_t* ptr = data->wr - len;
-    if (ptr < data->base)
-	data->wr = data->base;
+    uint8_t* lim = data->rope ? data->rd : data->base;
+    if (ptr < lim)
+	data->wr = lim;
     else
 	data->wr = ptr;
 }
@@ -296,6 +396,540 @@ static void ddata_send(ddata_t* data, int fd)
     write(fd, data->rd, len+4);
 }
 
+/*******************************************************************************
+ *
+ * Segmented ddata (rope)
+ *
+ *******************************************************************************/
+
+#ifndef NO_ERL_DRIVER
+// chunks are binaries so they can be passed to driver_outputv
+static uint8_t* ddata_chunk_alloc(size_t size, void** chunk)
+{
+    ErlDrvBinary* bin;
+
+    if ((bin = driver_alloc_binary(size)) == NULL)
+	return NULL;
+    *chunk = bin;
+    return (uint8_t*) bin->orig_bytes;
+}
+
+static void ddata_chunk_ref(void* chunk)
+{
+    driver_binary_inc_refc((ErlDrvBinary*) chunk);
+}
+
+static void ddata_chunk_unref(void* chunk)
+{
+    driver_free_binary((ErlDrvBinary*) chunk);
+}
+#else
+typedef struct
+{
+    long    refc;
+    uint8_t data[1];
+} ddata_chunk_t;
+
+static uint8_t* ddata_chunk_alloc(size_t size, void** chunk)
+{
+    ddata_chunk_t* cp;
+
+    if ((cp = DALLOC(sizeof(ddata_chunk_t)+size-1)) == NULL)
+	return NULL;
+    cp->refc = 1;
+    *chunk = cp;
+    return cp->data;
+}
+
+static void ddata_chunk_ref(void* chunk)
+{
+    ((ddata_chunk_t*) chunk)->refc++;
+}
+
+static void ddata_chunk_unref(void* chunk)
+{
+    if (--((ddata_chunk_t*) chunk)->refc == 0)
+	DFREE(chunk);
+}
+#endif
+
+// append a segment, the segment takes over the chunk reference
+static int ddata_rope_seg(ddata_rope_t* rope, uint8_t* ptr, size_t len,
+			  void* chunk, void (*release)(void*), void* arg)
+{
+    ddata_seg_t* seg;
+
+    if ((seg = DALLOC(sizeof(ddata_seg_t))) == NULL)
+	return -1;
+    seg->next    = NULL;
+    seg->ptr     = ptr;
+    seg->len     = len;
+    seg->chunk   = chunk;
+    seg->release = release;
+    seg->arg     = arg;
+    *rope->last = seg;
+    rope->last  = &seg->next;
+    rope->nseg++;
+    rope->len += len;
+    return 0;
+}
+
+// Put data in rope mode using a chunk size of chunk_size (0 = default)
+static int ddata_rope_init(ddata_t* data, ddata_rope_t* rope,
+			   size_t chunk_size)
+{
+    uint8_t* ptr;
+
+    if (chunk_size == 0)
+	chunk_size = DDATA_ROPE_CHUNK;
+    rope->first = NULL;
+    rope->last  = &rope->first;
+    rope->nseg  = 0;
+    rope->len   = 0;
+    rope->chunk_size = chunk_size;
+    if ((ptr = ddata_chunk_alloc(chunk_size, &rope->chunk)) == NULL)
+	return -1;
+    data->dyn_alloc = 0;
+    data->rope = rope;
+    data->base = ptr;
+    data->rd   = ptr;
+    data->wr   = ptr;
+    data->eob  = ptr + chunk_size;
+    return 0;
+}
+
+// drop all segments
+static void ddata_rope_drop(ddata_rope_t* rope)
+{
+    ddata_seg_t* seg = rope->first;
+
+    while(seg) {
+	ddata_seg_t* next = seg->next;
+	if (seg->chunk)
+	    ddata_chunk_unref(seg->chunk);
+	if (seg->release)
+	    (*seg->release)(seg->arg);
+	DFREE(seg);
+	seg = next;
+    }
+    rope->first = NULL;
+    rope->last  = &rope->first;
+    rope->nseg  = 0;
+    rope->len   = 0;
+}
+
+static void ddata_rope_final(ddata_t* data)
+{
+    ddata_rope_t* rope = data->rope;
+
+    ddata_rope_drop(rope);
+    if (rope->chunk)
+	ddata_chunk_unref(rope->chunk);
+    rope->chunk = NULL;
+    data->rope = NULL;
+    data->base = data->rd = data->wr = data->eob = NULL;
+}
+
+// Turn data written into the current chunk into a segment,
+// writing continues in the rest of the chunk
+static int ddata_rope_flush(ddata_t* data)
+{
+    ddata_rope_t* rope = data->rope;
+
+    if (data->wr > data->rd) {
+	ddata_chunk_ref(rope->chunk);
+	if (ddata_rope_seg(rope, data->rd, data->wr - data->rd,
+			   rope->chunk, NULL, NULL) < 0) {
+	    ddata_chunk_unref(rope->chunk);
+	    return -1;
+	}
+	data->rd = data->wr;
+    }
+    return 0;
+}
+
+// Called from ddata_realloc when the current chunk is full
+static int ddata_rope_next(ddata_t* data, size_t need)
+{
+    ddata_rope_t* rope = data->rope;
+    size_t size = (need > rope->chunk_size) ? need : rope->chunk_size;
+    uint8_t* ptr;
+    void* chunk;
+
+    if (ddata_rope_flush(data) < 0)
+	return -1;
+    if ((ptr = ddata_chunk_alloc(size, &chunk)) == NULL)
+	return -1;
+    ddata_chunk_unref(rope->chunk);
+    rope->chunk = chunk;
+    data->base = ptr;
+    data->rd   = ptr;
+    data->wr   = ptr;
+    data->eob  = ptr + size;
+    return 0;
+}
+
+// Total number of bytes written
+static size_t ddata_rope_size(ddata_t* data)
+{
+    return data->rope->len + (data->wr - data->rd);
+}
+
+// Add external data by reference, release(arg) is called when the
+// segment is dropped. On failure the caller keeps the data.
+static int ddata_rope_add_ref(ddata_t* data, uint8_t* ptr, size_t len,
+			      void (*release)(void*), void* arg)
+{
+    if (ddata_rope_flush(data) < 0)
+	return -1;
+    if (len == 0) {
+	if (release)
+	    (*release)(arg);
+	return 0;
+    }
+    return ddata_rope_seg(data->rope, ptr, len, NULL, release, arg);
+}
+
+#ifndef NO_ERL_DRIVER
+// Add (part of) a driver binary by reference
+static int ddata_rope_add_binary(ddata_t* data, ErlDrvBinary* bin,
+				 size_t offset, size_t len)
+{
+    if (ddata_rope_flush(data) < 0)
+	return -1;
+    if (len == 0)
+	return 0;
+    driver_binary_inc_refc(bin);
+    if (ddata_rope_seg(data->rope, (uint8_t*) bin->orig_bytes + offset, len,
+		       bin, NULL, NULL) < 0) {
+	driver_free_binary(bin);
+	return -1;
+    }
+    return 0;
+}
+#endif
+
+#ifndef __WIN32__
+// Fill iov with the segments, return number of iovec's used or -1
+// if more than max are needed.
+static int ddata_rope_iov(ddata_t* data, struct iovec* iov, int max)
+{
+    ddata_seg_t* seg;
+    int n = 0;
+
+    if (ddata_rope_flush(data) < 0)
+	return -1;
+    if (data->rope->nseg > max)
+	return -1;
+    for (seg = data->rope->first; seg != NULL; seg = seg->next) {
+	iov[n].iov_base = seg->ptr;
+	iov[n].iov_len  = seg->len;
+	n++;
+    }
+    return n;
+}
+
+// Drop len bytes from the front of the rope
+static void ddata_rope_consume(ddata_rope_t* rope, size_t len)
+{
+    ddata_seg_t* seg;
+
+    rope->len -= len;
+    while(((seg = rope->first) != NULL) && (len >= seg->len)) {
+	len -= seg->len;
+	rope->first = seg->next;
+	rope->nseg--;
+	if (seg->chunk)
+	    ddata_chunk_unref(seg->chunk);
+	if (seg->release)
+	    (*seg->release)(seg->arg);
+	DFREE(seg);
+    }
+    if (seg) {
+	seg->ptr += len;
+	seg->len -= len;
+    }
+    else
+	rope->last = &rope->first;
+}
+
+// Write the segments with writev, written data is dropped from the
+// rope. Return number of bytes written, this is less than the rope
+// size if fd would block, call again to write the rest. Return -1
+// on error or if fd would block before anything was written.
+static ssize_t ddata_rope_writev(ddata_t* data, int fd)
+{
+    struct iovec iov[DDATA_ROPE_IOV];
+    ddata_rope_t* rope = data->rope;
+    ssize_t total = 0;
+
+    if (ddata_rope_flush(data) < 0)
+	return -1;
+    while(rope->first) {
+	ddata_seg_t* sp = rope->first;
+	ssize_t r;
+	int n = 0;
+
+	while(sp && (n < DDATA_ROPE_IOV)) {
+	    iov[n].iov_base = sp->ptr;
+	    iov[n].iov_len  = sp->len;
+	    sp = sp->next;
+	    n++;
+	}
+	if ((r = writev(fd, iov, n)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (((errno == EAGAIN) || (errno == EWOULDBLOCK)) && (total > 0))
+		break;
+	    return -1;
+	}
+	total += r;
+	ddata_rope_consume(rope, (size_t) r);
+    }
+    return total;
+}
+
+// Rope version of ddata_send, the first 4 bytes must be reserved.
+// If not all is written continue with ddata_rope_writev.
+static ssize_t ddata_rope_send(ddata_t* data, int fd)
+{
+    ddata_seg_t* seg;
+    uint32_t len;
+
+    if (ddata_rope_flush(data) < 0)
+	return -1;
+    if (((seg = data->rope->first) == NULL) || (seg->len < 4))
+	return -1;
+    len = data->rope->len - 4;
+    DDATA_PUT_UINT32(seg->ptr, len);
+    return ddata_rope_writev(data, fd);
+}
+#endif
+
+#ifndef NO_ERL_DRIVER
+// Setup ev for driver_outputv, iov and binv must have room for
+// max elements. External segments are copied into binaries, others
+// are passed by reference. Return vsize or -1.
+static int ddata_rope_erliov(ddata_t* data, ErlIOVec* ev, SysIOVec* iov,
+			     ErlDrvBinary** binv, int max)
+{
+    ddata_seg_t* seg;
+    int n = 0;
+
+    if (ddata_rope_flush(data) < 0)
+	return -1;
+    if (data->rope->nseg > max)
+	return -1;
+    for (seg = data->rope->first; seg != NULL; seg = seg->next) {
+	if (seg->chunk == NULL) {
+	    ErlDrvBinary* bin;
+	    if ((bin = driver_alloc_binary(seg->len)) == NULL)
+		return -1;
+	    memcpy(bin->orig_bytes, seg->ptr, seg->len);
+	    if (seg->release)
+		(*seg->release)(seg->arg);
+	    seg->release = NULL;
+	    seg->ptr   = (uint8_t*) bin->orig_bytes;
+	    seg->chunk = bin;
+	}
+	iov[n].iov_base = (char*) seg->ptr;
+	iov[n].iov_len  = seg->len;
+	binv[n] = (ErlDrvBinary*) seg->chunk;
+	n++;
+    }
+    ev->vsize = n;
+    ev->size  = data->rope->len;
+    ev->iov   = iov;
+    ev->binv  = binv;
+    return n;
+}
+#endif
+
+/*******************************************************************************
+ *
+ * Array byte swap
+ *
+ *******************************************************************************/
+
+#if !defined(DDATA_BIG_ENDIAN) && !defined(DDATA_NO_SIMD) &&		\
+    (defined(__x86_64__) || defined(__i386__)) &&			\
+    (defined(__clang__) || (__GNUC__ > 4) ||				\
+     ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#define DDATA_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* convert n elements of size 1,2,4 or 8 between host and big endian */
+static void ddata_bswap_copy(uint8_t* dst, const uint8_t* src,
+			     size_t n, int size) __attribute__((unused));
+
+static void ddata_bswap_scalar(uint8_t* dst, const uint8_t* src,
+			       size_t n, int size)
+{
+    size_t i;
+
+    /* native load, big endian store (swap is its own inverse) */
+    switch(size) {
+    case 2:
+	for (i = 0; i < n; i++) {
+	    uint16_t v;
+	    memcpy(&v, src+2*i, 2);
+	    DDATA_PUT_UINT16(dst+2*i, v);
+	}
+	break;
+    case 4:
+	for (i = 0; i < n; i++) {
+	    uint32_t v;
+	    memcpy(&v, src+4*i, 4);
+	    DDATA_PUT_UINT32(dst+4*i, v);
+	}
+	break;
+    case 8:
+	for (i = 0; i < n; i++) {
+	    uint64_t v;
+	    memcpy(&v, src+8*i, 8);
+	    DDATA_PUT_UINT64(dst+8*i, v);
+	}
+	break;
+    default:
+	memcpy(dst, src, n*size);
+	break;
+    }
+}
+
+#ifdef DDATA_HAVE_X86_SIMD
+/* the kernels return number of bytes done, the rest is done by scalar */
+typedef size_t (*ddata_bswap_fn_t)(uint8_t* dst, const uint8_t* src,
+				   size_t len, int size);
+
+static ddata_bswap_fn_t ddata_bswap_simd __attribute__((unused));
+
+__attribute__((target("ssse3")))
+static size_t ddata_bswap_ssse3(uint8_t* dst, const uint8_t* src,
+				size_t len, int size)
+{
+    __m128i mask;
+    size_t i;
+
+    switch(size) {
+    case 2:
+	mask = _mm_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+	break;
+    case 4:
+	mask = _mm_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+	break;
+    case 8:
+	mask = _mm_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
+	break;
+    default:
+	return 0;
+    }
+    for (i = 0; i+16 <= len; i += 16) {
+	__m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+	_mm_storeu_si128((__m128i*)(dst+i), _mm_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t ddata_bswap_avx2(uint8_t* dst, const uint8_t* src,
+			       size_t len, int size)
+{
+    __m256i mask;
+    size_t i;
+
+    /* vpshufb shuffles within each 128 bit lane */
+    switch(size) {
+    case 2:
+	mask = _mm256_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+				1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+	break;
+    case 4:
+	mask = _mm256_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+				3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+	break;
+    case 8:
+	mask = _mm256_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8,
+				7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
+	break;
+    default:
+	return 0;
+    }
+    for (i = 0; i+64 <= len; i += 64) {
+	__m256i v0 = _mm256_loadu_si256((const __m256i*)(src+i));
+	__m256i v1 = _mm256_loadu_si256((const __m256i*)(src+i+32));
+	_mm256_storeu_si256((__m256i*)(dst+i), _mm256_shuffle_epi8(v0, mask));
+	_mm256_storeu_si256((__m256i*)(dst+i+32), _mm256_shuffle_epi8(v1,mask));
+    }
+    for (; i+32 <= len; i += 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i*)(src+i));
+	_mm256_storeu_si256((__m256i*)(dst+i), _mm256_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+
+static size_t ddata_bswap_none(uint8_t* dst, const uint8_t* src,
+			       size_t len, int size)
+{
+    (void) dst;
+    (void) src;
+    (void) len;
+    (void) size;
+    return 0;
+}
+
+/* select kernel on first use */
+static ddata_bswap_fn_t ddata_bswap_select(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	return ddata_bswap_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+	return ddata_bswap_ssse3;
+    return ddata_bswap_none;
+}
+#endif
+
+static void ddata_bswap_copy(uint8_t* dst, const uint8_t* src,
+			     size_t n, int size)
+{
+#ifdef DDATA_BIG_ENDIAN
+    memcpy(dst, src, n*size);
+#else
+    size_t done = 0;
+
+    if (size == 1) {
+	memcpy(dst, src, n);
+	return;
+    }
+#ifdef DDATA_HAVE_X86_SIMD
+    if (ddata_bswap_simd == NULL)
+	ddata_bswap_simd = ddata_bswap_select();
+    done = (*ddata_bswap_simd)(dst, src, n*size, size);
+#endif
+    ddata_bswap_scalar(dst+done, src+done, n - done/size, size);
+#endif
+}
+
+/* element size of array element tag, 0 if not a number tag */
+static inline int ddata_tag_size(uint8_t tag)
+{
+    switch(tag) {
+    case BOOLEAN:
+    case UINT8:
+    case INT8:    return 1;
+    case UINT16:
+    case INT16:   return 2;
+    case UINT32:
+    case INT32:
+    case FLOAT32: return 4;
+    case UINT64:
+    case INT64:
+    case FLOAT64: return 8;
+    default:      return 0;
+    }
+}
+
 /*******************************************************************************
  *
  * PUT Untagged data
@@ -463,6 +1097,136 @@ static inline void ddata_put_binary(ddata_t* data, const uint8_t* buf, uint32_t
     memcpy(ptr, buf, len);
 }
 
+// Put binary, in rope mode large binaries are added by reference and
+// release(arg) is called when the data is no longer used, otherwise
+// the data is copied and released directly.
+static void ddata_put_binary_ref(ddata_t* data, uint8_t* buf, uint32_t len,
+				 void (*release)(void*), void* arg)
+{
+    uint8_t* ptr;
+
+    if (!data->rope || (len < DDATA_ROPE_REF_MIN)) {
+	ddata_put_binary(data, buf, len);
+	if (release)
+	    (*release)(arg);
+	return;
+    }
+    ptr = ddata_alloc(data, 5);
+    *ptr++ = BINARY;
+    DDATA_PUT_UINT32(ptr, len);
+    if (ddata_rope_add_ref(data, buf, len, release, arg) < 0) {
+	ddata_add(data, buf, len);
+	if (release)
+	    (*release)(arg);
+    }
+}
+
+#ifndef NO_ERL_DRIVER
+// Put (part of) a driver binary, referenced in rope mode
+static void ddata_put_drv_binary(ddata_t* data, ErlDrvBinary* bin,
+				 size_t offset, uint32_t len)
+{
+    uint8_t* buf = (uint8_t*) bin->orig_bytes + offset;
+    uint8_t* ptr;
+
+    if (!data->rope || (len < DDATA_ROPE_REF_MIN)) {
+	ddata_put_binary(data, buf, len);
+	return;
+    }
+    ptr = ddata_alloc(data, 5);
+    *ptr++ = BINARY;
+    DDATA_PUT_UINT32(ptr, len);
+    if (ddata_rope_add_binary(data, bin, offset, len) < 0)
+	ddata_add(data, buf, len);
+}
+#endif
+
+/* put n elements as ARRAY, tag is the element tag (BOOLEAN..FLOAT64).
+ * 0 is returned, and nothing is written, if tag is not a number tag.
+ */
+static inline int ddata_put_array(ddata_t* data, uint8_t tag,
+				  const void* src, uint32_t n)
+{
+    int size = ddata_tag_size(tag);
+    uint8_t* ptr;
+
+    if (size == 0)
+	return 0;
+    ptr = ddata_alloc(data, 6 + (size_t)n*size);
+    *ptr++ = ARRAY;
+    *ptr++ = tag;
+    DDATA_PUT_UINT32(ptr, n);
+    ptr += 4;
+    ddata_bswap_copy(ptr, (const uint8_t*) src, n, size);
+    return 1;
+}
+
+static inline int ddata_put_boolean_array(ddata_t* data, const uint8_t* src,
+					  uint32_t n)
+{
+    return ddata_put_array(data, BOOLEAN, src, n);
+}
+
+static inline int ddata_put_uint8_array(ddata_t* data, const uint8_t* src,
+					uint32_t n)
+{
+    return ddata_put_array(data, UINT8, src, n);
+}
+
+static inline int ddata_put_int8_array(ddata_t* data, const int8_t* src,
+				       uint32_t n)
+{
+    return ddata_put_array(data, INT8, src, n);
+}
+
+static inline int ddata_put_uint16_array(ddata_t* data, const uint16_t* src,
+					 uint32_t n)
+{
+    return ddata_put_array(data, UINT16, src, n);
+}
+
+static inline int ddata_put_uint32_array(ddata_t* data, const uint32_t* src,
+					 uint32_t n)
+{
+    return ddata_put_array(data, UINT32, src, n);
+}
+
+static inline int ddata_put_uint64_array(ddata_t* data, const uint64_t* src,
+					 uint32_t n)
+{
+    return ddata_put_array(data, UINT64, src, n);
+}
+
+static inline int ddata_put_int16_array(ddata_t* data, const int16_t* src,
+					uint32_t n)
+{
+    return ddata_put_array(data, INT16, src, n);
+}
+
+static inline int ddata_put_int32_array(ddata_t* data, const int32_t* src,
+					uint32_t n)
+{
+    return ddata_put_array(data, INT32, src, n);
+}
+
+static inline int ddata_put_int64_array(ddata_t* data, const int64_t* src,
+					uint32_t n)
+{
+    return ddata_put_array(data, INT64, src, n);
+}
+
+static inline int ddata_put_float32_array(ddata_t* data, const float* src,
+					  uint32_t n)
+{
+    return ddata_put_array(data, FLOAT32, src, n);
+}
+
+static inline int ddata_put_float64_array(ddata_t* data, const double* src,
+					  uint32_t n)
+{
+    return ddata_put_array(data, FLOAT64, src, n);
+}
+
 /*******************************************************************************
  *
  * GET untagged data
@@ -516,4 +1280,102 @@ static inline int ddata_get_uint64(ddata_t* data, uint64_t* val)
     data->rd += sizeof(uint64_t);
     return 1;
 }
+
+/* peek at ARRAY element tag and count */
+static inline int ddata_get_array_size(ddata_t* data, uint8_t* tag,
+				       uint32_t* n)
+{
+    if (ddata_r_avail(data) < 6) return 0;
+    if (data->rd[0] != ARRAY) return 0;
+    *tag = data->rd[1];
+    *n = DDATA_GET_UINT32(data->rd+2);
+    return 1;
+}
+
+/* get ARRAY of tag elements into dst, *n is the size of dst on input
+ * and the number of elements on return. 0 is returned if the data is
+ * not such an array, is incomplete or does not fit.
+ */
+static inline int ddata_get_array(ddata_t* data, uint8_t tag,
+				  void* dst, uint32_t* n)
+{
+    int size = ddata_tag_size(tag);
+    uint8_t atag;
+    uint32_t k;
+
+    if (!ddata_get_array_size(data, &atag, &k)) return 0;
+    if ((atag != tag) || (size == 0) || (k > *n)) return 0;
+    if (ddata_r_avail(data) < 6 + (size_t)k*size) return 0;
+    ddata_bswap_copy((uint8_t*) dst, data->rd+6, k, size);
+    data->rd += 6 + (size_t)k*size;
+    *n = k;
+    return 1;
+}
+
+static inline int ddata_get_boolean_array(ddata_t* data, uint8_t* dst,
+					  uint32_t* n)
+{
+    return ddata_get_array(data, BOOLEAN, dst, n);
+}
+
+static inline int ddata_get_uint8_array(ddata_t* data, uint8_t* dst,
+					uint32_t* n)
+{
+    return ddata_get_array(data, UINT8, dst, n);
+}
+
+static inline int ddata_get_int8_array(ddata_t* data, int8_t* dst,
+				       uint32_t* n)
+{
+    return ddata_get_array(data, INT8, dst, n);
+}
+
+static inline int ddata_get_uint16_array(ddata_t* data, uint16_t* dst,
+					 uint32_t* n)
+{
+    return ddata_get_array(data, UINT16, dst, n);
+}
+
+static inline int ddata_get_uint32_array(ddata_t* data, uint32_t* dst,
+					 uint32_t* n)
+{
+    return ddata_get_array(data, UINT32, dst, n);
+}
+
+static inline int ddata_get_uint64_array(ddata_t* data, uint64_t* dst,
+					 uint32_t* n)
+{
+    return ddata_get_array(data, UINT64, dst, n);
+}
+
+static inline int ddata_get_int16_array(ddata_t* data, int16_t* dst,
+					uint32_t* n)
+{
+    return ddata_get_array(data, INT16, dst, n);
+}
+
+static inline int ddata_get_int32_array(ddata_t* data, int32_t* dst,
+					uint32_t* n)
+{
+    return ddata_get_array(data, INT32, dst, n);
+}
+
+static inline int ddata_get_int64_array(ddata_t* data, int64_t* dst,
+					uint32_t* n)
+{
+    return ddata_get_array(data, INT64, dst, n);
+}
+
+static inline int ddata_get_float32_array(ddata_t* data, float* dst,
+					  uint32_t* n)
+{
+    return ddata_get_array(data, FLOAT32, dst, n);
+}
+
+static inline int ddata_get_float64_array(ddata_t* data, double* dst,
+					  uint32_t* n)
+{
+    return ddata_get_array(data, FLOAT64, dst, n);
+}
+
 #endif
@@ -25,9 +25,13 @@ struct _dterm_t;
 // ErlDrvTerm construction 
 #define DTERM_EXTRA  64
 #define DTERM_FIXED  256
+#define DTERM_CHUNK  4096  // auxiliary data arena chunk size
 
+// Auxiliary data arena chunk, chunks are kept by dterm_reset and
+// freed by dterm_finish
 typedef struct _dterm_link_t {
     struct _dterm_link_t* next;
+    size_t size;             // size of data
     unsigned char data[];
 } dterm_link_t;
 
@@ -37,13 +41,41 @@ typedef struct _dterm_mark_t {
     size_t           count;   // number of elements
 } dterm_mark_t;
 
+// Interned atom, declare hot atoms with DTERM_ATOM(var, "name"), they
+// are made by dterm_lib_init (or on first use) and read with
+// DTERM_ATOM_VALUE(var)
+typedef struct _dterm_atom_t {
+    struct _dterm_atom_t* next;  // registered atoms
+    const char*    name;
+    ErlDrvTermData atom;         // 0 until made
+} dterm_atom_t;
+
+extern void dterm_atom_register(dterm_atom_t* a);
+extern ErlDrvTermData dterm_atom_resolve(dterm_atom_t* a);
+
+#if defined(__GNUC__)
+#define DTERM_ATOM(var, str)						\
+    static dterm_atom_t var = { NULL, (str), 0 };			\
+    static void __attribute__((constructor)) var##_register(void)	\
+    { dterm_atom_register(&var); }
+#else
+#define DTERM_ATOM(var, str)			\
+    static dterm_atom_t var = { NULL, (str), 0 };
+#endif
+
+#define DTERM_ATOM_VALUE(var) \
+    ((var).atom ? (var).atom : dterm_atom_resolve(&(var)))
+
 typedef struct _dterm_t {
     int dyn_alloc;
     int dyn_size;    // real size of data (if dynamic)
     ErlDrvTermData* base;
     ErlDrvTermData* ptr;
     ErlDrvTermData* ptr_end;
-    dterm_link_t* head;
+    dterm_link_t* head;      // arena chunks
+    dterm_link_t* cur;       // chunk in use (NULL = none yet)
+    unsigned char* aptr;     // next free byte in cur
+    unsigned char* aend;     // end of cur
     dterm_mark_t* mark;
     ErlDrvTermData  data[DTERM_FIXED];
 } dterm_t;
@@ -58,8 +90,11 @@ extern int dterm_expand(dterm_t* p, size_t n);
 extern void* dterm_link_alloc_data(dterm_t* p, size_t size);
 extern void* dterm_link_copy_data(dterm_t* p, void* src, size_t size);
 
+extern ErlDrvTermData dterm_mk_atom(const char* name);
+
 extern int dterm_dyn_size(ErlDrvTermData* spec, int len);
 extern char* dterm_dyn_copy(ErlDrvTermData* spec, int len, char* ptr);
+extern void dterm_dyn_release(ErlDrvTermData* spec, int len);
 extern int dterm_dump(FILE*, ErlDrvTermData* spec, int len);
 
 extern void dterm_kv_int(dterm_t* t,ErlDrvTermData key, ErlDrvSInt value);
@@ -182,6 +217,12 @@ static inline int dterm_atom(dterm_t* p, ErlDrvTermData atom)
     return dterm_put2(p, ERL_DRV_ATOM, atom);
 }
 
+// atom from the interned atom cache
+static inline int dterm_atom_cstr(dterm_t* p, const char* name)
+{
+    return dterm_put2(p, ERL_DRV_ATOM, dterm_mk_atom(name));
+}
+
 static inline int dterm_port(dterm_t* p, ErlDrvTermData port)
 {
     return dterm_put2(p, ERL_DRV_PORT, port);
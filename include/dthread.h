@@ -18,6 +18,14 @@
 #define __DTHREAD_H__
 
 struct _dthread_t;
+struct _dthread_reactor_t;
+struct _dthread_io_ctx_t;
+struct _dthread_pool_t;
+struct _dthread_timers_t;
+struct _dthread_replies_t;
+struct _dthread_chans_t;
+struct _dthread_chan_t;
+struct _ddata_t;
 
 #include "erl_driver.h"
 #include "dterm.h"
@@ -49,12 +57,75 @@ typedef int  ErlDrvSSizeT;
 #define DTHREAD_CLOSE_EVENT(e) close(DTHREAD_EVENT(e))
 #endif
 
+// Input queue implementation, selected per thread with dthread_queue_mode
+//
+// DTHREAD_QUEUE_MUTEX: the original queue, every send/recv takes iq_mtx.
+// DTHREAD_QUEUE_LOCKFREE: intrusive multi producer / single consumer
+//   queue. Senders do one atomic exchange on iq_rear and never block,
+//   the (single!) receiver unlinks from iq_front without locking.
+//   Messages from one sender are received in the order they were sent,
+//   messages from different senders are received in the order their
+//   exchange on iq_rear took effect. A sender preempted between the
+//   exchange and the link may briefly hide messages queued after it,
+//   dthread_recv then returns NULL while iq_len > 0 and the signal
+//   stays set so the receiver will simply try again.
+//
+#define DTHREAD_QUEUE_MUTEX     0
+#define DTHREAD_QUEUE_LOCKFREE  1
+
+// Priority lanes, each lane is a queue as above, so ordering is only
+// kept within a lane. dthread_recv serve the highest non-empty lane
+// first (see dthread_queue_aging).
+#define DTHREAD_PRIO_HIGH       0
+#define DTHREAD_PRIO_NORMAL     1
+#define DTHREAD_PRIO_BULK       2
+#define DTHREAD_NUM_PRIO        3
+
+#if !defined(DTHREAD_NO_LOCKFREE) && defined(__ATOMIC_SEQ_CST)
+#define DTHREAD_HAVE_LOCKFREE 1
+#endif
+
+// Queue signal backend, Linux use one eventfd (iq_signal[0] only)
+// instead of a pipe pair
+#if defined(__linux__) && !defined(DTHREAD_NO_EVENTFD)
+#define DTHREAD_HAVE_EVENTFD 1
+#endif
+
+// Reactor backend, Linux use epoll else dthread_poll
+#if defined(__linux__) && !defined(DTHREAD_NO_EPOLL)
+#define DTHREAD_HAVE_EPOLL 1
+#endif
+
+// Asynchronous io backend, build with -DDTHREAD_IO_URING to use
+// io_uring on Linux (falls back to dthread_poll if the kernel refuse)
+#if defined(__linux__) && defined(DTHREAD_IO_URING)
+#define DTHREAD_HAVE_IO_URING 1
+#endif
+
+#ifndef DTHREAD_CACHE_LINE_SIZE
+#define DTHREAD_CACHE_LINE_SIZE 64
+#endif
+
 // Builtin commands are negative, user command must > 0
 
 #define DTHREAD_STOP          -1
 #define DTHREAD_SEND_TERM     -2
 #define DTHREAD_OUTPUT_TERM   -3
 #define DTHREAD_OUTPUT        -4
+#define DTHREAD_QUEUE_LOW     -5   // input queue drained to low watermark
+#define DTHREAD_TIMEOUT       -6   // timer expired (udata = timer arg)
+#define DTHREAD_CANCEL        -7   // withdraw request ref (internal)
+#define DTHREAD_PURGE         -8   // withdraw requests from pid (internal)
+
+// Data from dthread_port_output* as (like inet {mode, list|binary})
+#define DTHREAD_OUTPUT_LIST    0
+#define DTHREAD_OUTPUT_BINARY  1
+
+#define DMESSAGE_KEYED  0x0001  // routed on key, never stolen
+#define DMESSAGE_HIGH   0x0002  // queue in DTHREAD_PRIO_HIGH lane
+#define DMESSAGE_BULK   0x0004  // queue in DTHREAD_PRIO_BULK lane
+#define DMESSAGE_CANCELLED 0x0008 // withdrawn, dropped when received
+#define DMESSAGE_REQUEST 0x0010 // request, source->req_done called on free
 
 typedef struct _dmessage_t
 {
@@ -66,9 +137,14 @@ typedef struct _dmessage_t
     ErlDrvTermData        to;   // receiver pid (if any)
     ErlDrvTermData        ref;  // sender ref
     void* udata;                // user data
+    unsigned int flags;         // DMESSAGE_KEYED ...
+    unsigned int key;           // routing key (DMESSAGE_KEYED)
+    int   mclass;         // allocation size class (-1 = not cached)
     size_t size;          // total allocated size of buffer
     size_t used;          // total used part of buffer
     char*  buffer;        // points to data or allocated
+    SysIOVec* iov;        // payload segments (outputv messages)
+    int    iovcnt;        // number of segments in iov
     char   data[0];
 } dmessage_t;
 
@@ -81,14 +157,46 @@ typedef struct _dthread_t {
     ErlDrvTermData caller;      // last caller (driver_caller)
     ErlDrvTermData    ref;      // last sender ref
     int       smp_support;      // SMP support or not
+    int       output_mode;      // DTHREAD_OUTPUT_LIST | DTHREAD_OUTPUT_BINARY
+    int       iq_mode;          // DTHREAD_QUEUE_MUTEX | DTHREAD_QUEUE_LOCKFREE
+    struct _dthread_reactor_t* reactor; // registered events (consumer only)
+    struct _dthread_io_ctx_t* io;       // asynchronous io (consumer only)
+    struct _dthread_pool_t* pool;       // worker pool (if pool member)
+    struct _dthread_timers_t* timers;   // timer wheel (consumer only)
+    struct _dthread_replies_t* replies; // coalesced replies (consumer only)
+    struct _dthread_chans_t* chans;     // framed channel buffers (consumer only)
+    int            reply_max;    // coalesce up to reply_max replies (0=off)
+    ErlDrvTime     reply_delay;  // max usec a reply is held back
+    // called from any thread when a request (DMESSAGE_REQUEST) sent
+    // by this thread is freed: handled, cancelled or purged
+    void (*req_done)(struct _dthread_t* source, dmessage_t* mp);
 
     // Input queue
-    ErlDrvMutex*   iq_mtx;       // message queue lock
-    int            iq_len;       // message queue length
-    dmessage_t*    iq_front;     // get from front
-    dmessage_t*    iq_rear;      // put to rear
-    
+    ErlDrvMutex*   iq_mtx;       // message queue lock (mutex mode)
     ErlDrvEvent    iq_signal[2]; // event signaled when items is enqueued
+                                 // [0]=read end, [1]=write end (pipe only)
+    int            iq_low_len;   // watermarks, busy at high, not busy at low
+    int            iq_high_len;  // (high 0 = no limit)
+    size_t         iq_low_bytes;
+    size_t         iq_high_bytes;
+
+    // producer side, keep apart from consumer side to avoid false sharing
+    char           iq_pad0[DTHREAD_CACHE_LINE_SIZE];
+    dmessage_t*    iq_rear[DTHREAD_NUM_PRIO];  // put to rear
+    int            iq_len;       // message queue length
+    int            iq_sleeping;  // consumer wait on signal, else no signal
+    size_t         iq_bytes;     // sum of queued message data
+    int            iq_busy;      // high watermark reached
+
+    // consumer side
+    char           iq_pad1[DTHREAD_CACHE_LINE_SIZE];
+    dmessage_t*    iq_front[DTHREAD_NUM_PRIO]; // get from front
+    dmessage_t     iq_stub[DTHREAD_NUM_PRIO];  // stub nodes (lock-free mode)
+    int            iq_aging;     // serve lowest lane every n:th recv (0=off)
+    int            iq_served;    // messages served since lowest lane was served
+    int            iq_spin_max;  // dthread_poll spin limit (0 = no spin)
+    int            iq_spin;      // current adaptive spin limit
+    char           iq_pad2[DTHREAD_CACHE_LINE_SIZE];
 } dthread_t;
 
 #define ERL_DRV_EXCEP  (1 << 7)
@@ -99,6 +207,67 @@ typedef struct _dthread_poll_event_t {
     int revents;         // ERL_DRV_READ | WRITE
 } dthread_poll_event_t;
 
+// called from dthread_reactor_wait with the ready event (revents set)
+typedef void (*dthread_handler_t)(dthread_t* thr, dthread_poll_event_t* pev,
+				  void* arg);
+
+// Framed ddata channel, frames are a 4 byte length followed by the data
+// (as ddata_send). The channel fd is set non-blocking.
+typedef struct _dthread_chan_t dthread_chan_t;
+
+// called with each received frame, valid until the callback returns.
+// frame is NULL on end of file (errno=0) or error (errno set).
+typedef void (*dthread_chan_cb_t)(dthread_chan_t* chan,
+				  struct _ddata_t* frame, void* arg);
+
+// Asynchronous io operations
+#define DTHREAD_IO_READ     1
+#define DTHREAD_IO_WRITE    2
+#define DTHREAD_IO_ACCEPT   3
+#define DTHREAD_IO_TIMEOUT  4
+
+struct _dthread_io_t;
+
+// res is number of bytes, accepted fd, 0 for timeout or -errno
+typedef void (*dthread_io_done_t)(dthread_t* thr, struct _dthread_io_t* io,
+				  int res);
+
+// owned by caller and must be kept until done is called
+typedef struct _dthread_io_t {
+    struct _dthread_io_t* next; // pending list (private)
+    int         op;             // DTHREAD_IO_READ|WRITE|ACCEPT|TIMEOUT
+    ErlDrvEvent event;          // file descriptor (not TIMEOUT)
+    void*       buf;            // READ/WRITE buffer
+    size_t      len;            // READ/WRITE length
+    int         timeout;        // TIMEOUT in milliseconds
+    dthread_io_done_t done;     // completion callback
+    void*       arg;            // user data
+    ErlDrvSInt64 ts[2];         // timespec / deadline (private)
+} dthread_io_t;
+
+struct _dthread_timer_t;
+
+typedef void (*dthread_timer_cb_t)(dthread_t* thr, struct _dthread_timer_t* t,
+				   void* arg);
+
+// owned by caller, zero before first use and keep until expired or
+// cancelled
+typedef struct _dthread_timer_t {
+    struct _dthread_timer_t*  next;   // wheel slot list (private)
+    struct _dthread_timer_t** pprev;  // NULL when not running (private)
+    ErlDrvUInt64 expire;              // expire tick (private)
+    dthread_timer_cb_t cb;            // NULL = send DTHREAD_TIMEOUT message
+    void* arg;                        // user data
+} dthread_timer_t;
+
+// A pool of worker threads, each with its own queue
+typedef struct _dthread_pool_t {
+    int         n;       // number of workers
+    int         next;    // round robin start for dthread_pool_send
+    int         keylen;  // route on first keylen bytes of data (0 = off)
+    dthread_t** thr;     // workers
+} dthread_pool_t;
+
 extern void dthread_lib_init(void);
 extern void dthread_lib_finish(void);
 
@@ -109,6 +278,9 @@ extern dmessage_t* dmessage_create_r(int cmd,
 				     void* udata,
 				     char* buf, size_t len);
 extern dmessage_t* dmessage_create(int cmd,char* buf, size_t len);
+extern dmessage_t* dmessage_create_term(int cmd);
+extern dterm_t* dmessage_term(dmessage_t* mp);
+extern void dmessage_term_end(dmessage_t* mp);
 
 extern void dthread_event_close(ErlDrvEvent);
 extern int dthread_signal_set(dthread_t* thr);
@@ -122,25 +294,90 @@ extern void dthread_signal_finish(dthread_t* thr, int and_close);
 extern int dthread_poll(dthread_t* thr,
 			dthread_poll_event_t* events,
 			size_t* npevs, int timeout);
+extern void dthread_poll_spin(dthread_t* thr, int spin);
+
+extern int dthread_reactor_add(dthread_t* thr, ErlDrvEvent event, int events,
+			       dthread_handler_t handler, void* arg);
+extern int dthread_reactor_mod(dthread_t* thr, ErlDrvEvent event, int events);
+extern int dthread_reactor_del(dthread_t* thr, ErlDrvEvent event);
+extern int dthread_reactor_wait(dthread_t* thr, int timeout);
+extern void dthread_reactor_finish(dthread_t* thr);
+
+extern int dthread_timer_start(dthread_t* thr, dthread_timer_t* t,
+			       ErlDrvTime usec, dthread_timer_cb_t cb,
+			       void* arg);
+extern int dthread_timer_cancel(dthread_t* thr, dthread_timer_t* t);
+extern int dthread_timer_expire(dthread_t* thr);
+extern ErlDrvTime dthread_timer_next(dthread_t* thr);
+extern void dthread_timer_finish(dthread_t* thr);
+
+extern int dthread_io_submit(dthread_t* thr, dthread_io_t* io);
+extern int dthread_io_wait(dthread_t* thr, int timeout);
+extern void dthread_io_finish(dthread_t* thr);
+
+extern dthread_chan_t* dthread_chan_open(dthread_t* thr, ErlDrvEvent event,
+					 dthread_chan_cb_t cb, void* arg);
+extern void dthread_chan_close(dthread_chan_t* chan);
+extern int dthread_chan_send(dthread_chan_t* chan, struct _ddata_t* data);
+extern int dthread_chan_flush(dthread_chan_t* chan);
+extern size_t dthread_chan_pending(dthread_chan_t* chan);
+extern int dthread_chan_events(dthread_chan_t* chan);
+extern void dthread_chan_poll_event(dthread_chan_t* chan,
+				    dthread_poll_event_t* pev);
+extern int dthread_chan_handle(dthread_chan_t* chan,
+			       dthread_poll_event_t* pev);
+extern int dthread_chan_attach(dthread_chan_t* chan);
+extern void dthread_chan_finish(dthread_t* thr);
+
+extern int dthread_queue_mode(dthread_t* thr, int mode);
+extern void dthread_queue_limits(dthread_t* thr,
+				 int low_len, int high_len,
+				 size_t low_bytes, size_t high_bytes);
+extern int dthread_queue_busy(dthread_t* thr);
+extern void dthread_queue_aging(dthread_t* thr, int n);
+extern void dmessage_set_prio(dmessage_t* mp, int prio);
 
 extern int dthread_send(dthread_t* thr, dthread_t* source,
 			dmessage_t* mp);
+extern int dthread_send_batch(dthread_t* thr, dthread_t* source,
+			      dmessage_t* first, dmessage_t* last, int n);
 
 extern int dthread_control(dthread_t* thr, dthread_t* source,
 			   int cmd, char* buf, int len);
 extern int dthread_output(dthread_t* thr, dthread_t* source,
 			  char* buf, int len);
+extern int dthread_outputv(dthread_t* thr, dthread_t* source,
+			   ErlIOVec* ev);
+
+extern int dthread_pool_send(dthread_pool_t* pool, dthread_t* source,
+			     dmessage_t* mp);
+extern int dthread_pool_send_key(dthread_pool_t* pool, dthread_t* source,
+				 dmessage_t* mp, unsigned int key);
+extern unsigned int dthread_key_hash(const char* buf, size_t len);
+extern int dthread_pool_control(dthread_pool_t* pool, dthread_t* source,
+				int cmd, char* buf, int len);
+extern int dthread_pool_output(dthread_pool_t* pool, dthread_t* source,
+			       char* buf, int len);
+extern int dthread_pool_outputv(dthread_pool_t* pool, dthread_t* source,
+				ErlIOVec* ev);
 
 extern int dthread_port_send_dterm(dthread_t* thr, dthread_t* source, 
 				   ErlDrvTermData target, dterm_t* p);
 extern int dthread_port_output_dterm(dthread_t* thr, dthread_t* source, 
 				     dterm_t* p);
 
+// send a message from dmessage_create_term (consumed)
+extern int dthread_port_send_dmessage(dthread_t* thr, dthread_t* source,
+				      ErlDrvTermData target, dmessage_t* mp);
+extern int dthread_port_output_dmessage(dthread_t* thr, dthread_t* source,
+					dmessage_t* mp);
+
 extern int dthread_port_send_term(dthread_t* thr, dthread_t* source,
 				  ErlDrvTermData target,
 				  ErlDrvTermData* spec, int len);
 extern int dthread_port_output_term(dthread_t* thr, dthread_t* source,
 				    ErlDrvTermData* spec, int len);
+extern void dthread_port_output_mode(dthread_t* thr, int mode);
 extern int dthread_port_output(dthread_t* thr, dthread_t* source,
 			       char* buf, int len);
 extern int dthread_port_output2(dthread_t* thr, dthread_t* source,
@@ -151,6 +388,19 @@ extern int dthread_port_output_binary(dthread_t* thr, dthread_t* source,
 				      ErlDrvBinary* bin,
 				      ErlDrvSizeT offset, ErlDrvSizeT len);
 
+// Reply coalescing, replies from source are buffered per target and
+// sent as one list [Reply1,...,ReplyN] (see dthread_reply_coalesce),
+// a direct send from source to target sends buffered replies first
+extern int dthread_port_reply_term(dthread_t* thr, dthread_t* source,
+				   ErlDrvTermData target,
+				   ErlDrvTermData* spec, int len);
+extern int dthread_port_reply_dterm(dthread_t* thr, dthread_t* source,
+				    ErlDrvTermData target, dterm_t* p);
+extern void dthread_reply_coalesce(dthread_t* self, int max,
+				   ErlDrvTime delay);
+extern int dthread_reply_flush(dthread_t* self);
+extern void dthread_reply_finish(dthread_t* self);
+
 // send {Ref::uint32(), ok}
 extern int dthread_port_send_ok(dthread_t* thr, dthread_t* source,
 				ErlDrvTermData target, ErlDrvTermData ref);
@@ -161,6 +411,16 @@ extern int dthread_port_send_error(dthread_t* thr, dthread_t* source,
 
 
 extern dmessage_t* dthread_recv(dthread_t* self, dthread_t** source);
+extern dmessage_t* dthread_recv_all(dthread_t* self, dthread_t** source);
+
+extern int dthread_cancel(dthread_t* thr, dthread_t* source,
+			  ErlDrvTermData ref, ErlDrvTermData caller);
+extern int dthread_purge(dthread_t* thr, dthread_t* source,
+			 ErlDrvTermData pid);
+extern int dthread_pool_cancel(dthread_pool_t* pool, dthread_t* source,
+			       ErlDrvTermData ref, ErlDrvTermData caller);
+extern int dthread_pool_purge(dthread_pool_t* pool, dthread_t* source,
+			      ErlDrvTermData pid);
 
 extern int dthread_init(dthread_t* thr, ErlDrvPort port);
 extern void dthread_finish(dthread_t* thr);
@@ -171,4 +431,11 @@ extern int dthread_stop(dthread_t* target, dthread_t* source,
 			void** exit_value);
 extern void dthread_exit(void* value);
 
+extern dthread_pool_t* dthread_pool_start(ErlDrvPort port, int n,
+					  void* (*func)(void* arg),
+					  void* arg, int stack_size);
+extern int dthread_pool_stop(dthread_pool_t* pool, dthread_t* source);
+extern dmessage_t* dthread_pool_recv(dthread_t* self, dthread_t** source);
+extern int dthread_pool_busy(dthread_pool_t* pool);
+
 #endif
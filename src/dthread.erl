@@ -25,11 +25,35 @@
 
 -compile(export_all).
 
+%% port_control 0 is handled by the driver
+-define(DRV_CTL, 0).
+-define(DRV_CTL_SETOPTS, 1).
+-define(DRV_CTL_CANCEL, 2).
+
+-define(DRV_OPT_BUDGET, 1).
+-define(DRV_OPT_KEYLEN, 2).
+-define(DRV_OPT_QUEUE_LOW, 3).
+-define(DRV_OPT_QUEUE_HIGH, 4).
+-define(DRV_OPT_QUEUE_LOW_BYTES, 5).
+-define(DRV_OPT_QUEUE_HIGH_BYTES, 6).
+-define(DRV_OPT_MSGQ_LOW, 7).
+-define(DRV_OPT_MSGQ_HIGH, 8).
+-define(DRV_OPT_CMD_PRIO, 9).
+-define(DRV_OPT_AGING, 10).
+-define(DRV_OPT_REPLY_MAX, 11).
+-define(DRV_OPT_REPLY_DELAY, 12).
+-define(DRV_OPT_MODE, 13).
+
 
 open() ->
+    open(1).
+
+%% Open with a pool of Workers threads
+open(Workers) when is_integer(Workers), Workers > 0 ->
     case erl_ddll:load_driver(code:priv_dir(dthread), "dthread_drv") of
 	ok ->
-	    open_port({spawn_driver, dthread_drv}, [binary]);
+	    open_port({spawn_driver, "dthread_drv "++integer_to_list(Workers)},
+		      [binary]);
 	{error,Error} ->
 	    io:format("erl_ddll: error:\n~s\n",
 		      [erl_ddll:format_error(Error)]),
@@ -39,6 +63,72 @@ open() ->
 close(Port) ->
     port_close(Port).
 
+%% Set driver options
+%%   {budget, N}  max number of replies delivered per port wakeup
+%%   {key_length, N}  requests with the same first N data bytes are
+%%                    handled in order by the same worker (0 = off)
+%%   {queue_low, N} {queue_high, N}  worker queue watermarks in messages
+%%   {queue_low_bytes, N} {queue_high_bytes, N}  and in bytes, the port
+%%                    is busy from a high mark until back at the low marks
+%%   {msgq_low, N} {msgq_high, N}  port message queue limits, msgq_high 0
+%%                    disables the busy message queue, msgq_low must be > 0
+%%   {priority, Cmd, high|normal|bulk}  queue lane for command Cmd (< 256)
+%%   {aging, N}       serve the lowest lane every N:th message (0 = off)
+%%   {reply_max, N}   send replies to the same process as lists of up
+%%                    to N replies (0 = off)
+%%   {reply_delay, Us} max microseconds a reply is held back
+%%   {mode, list|binary}  data in {Port,{data,Data}} from the workers
+setopts(Port, Opts) ->
+    Data = [encode_opt(Opt) || Opt <- Opts],
+    case port_control(Port, ?DRV_CTL, [?DRV_CTL_SETOPTS | Data]) of
+	<<0>> -> ok;
+	<<1, Error/binary>> -> {error, binary_to_atom(Error, latin1)}
+    end.
+
+encode_opt({budget, N}) when is_integer(N), N > 0 ->
+    <<?DRV_OPT_BUDGET, N:32>>;
+encode_opt({key_length, N}) when is_integer(N), N >= 0 ->
+    <<?DRV_OPT_KEYLEN, N:32>>;
+encode_opt({queue_low, N}) when is_integer(N), N >= 0 ->
+    <<?DRV_OPT_QUEUE_LOW, N:32>>;
+encode_opt({queue_high, N}) when is_integer(N), N >= 0 ->
+    <<?DRV_OPT_QUEUE_HIGH, N:32>>;
+encode_opt({queue_low_bytes, N}) when is_integer(N), N >= 0 ->
+    <<?DRV_OPT_QUEUE_LOW_BYTES, N:32>>;
+encode_opt({queue_high_bytes, N}) when is_integer(N), N >= 0 ->
+    <<?DRV_OPT_QUEUE_HIGH_BYTES, N:32>>;
+encode_opt({msgq_low, N}) when is_integer(N), N > 0 ->
+    <<?DRV_OPT_MSGQ_LOW, N:32>>;
+encode_opt({msgq_high, N}) when is_integer(N), N >= 0 ->
+    <<?DRV_OPT_MSGQ_HIGH, N:32>>;
+encode_opt({priority, Cmd, Prio}) when is_integer(Cmd), Cmd > 0, Cmd < 256 ->
+    <<?DRV_OPT_CMD_PRIO, Cmd:24, (encode_prio(Prio)):8>>;
+encode_opt({aging, N}) when is_integer(N), N >= 0 ->
+    <<?DRV_OPT_AGING, N:32>>;
+encode_opt({reply_max, N}) when is_integer(N), N >= 0 ->
+    <<?DRV_OPT_REPLY_MAX, N:32>>;
+encode_opt({reply_delay, Us}) when is_integer(Us), Us >= 0 ->
+    <<?DRV_OPT_REPLY_DELAY, Us:32>>;
+encode_opt({mode, list}) ->
+    <<?DRV_OPT_MODE, 0:32>>;
+encode_opt({mode, binary}) ->
+    <<?DRV_OPT_MODE, 1:32>>.
+
+encode_prio(high) -> 0;
+encode_prio(normal) -> 1;
+encode_prio(bulk) -> 2.
+
+%% Withdraw a queued request, Ref is the reference returned by the
+%% port_control call. Only requests sent by the calling process are
+%% withdrawn. A worker may already have picked the request up,
+%% so the reply may still arrive. Requests from a caller that dies are
+%% dropped by the driver.
+cancel(Port, Ref) when is_integer(Ref), Ref >= 0 ->
+    case port_control(Port, ?DRV_CTL, <<?DRV_CTL_CANCEL, Ref:32>>) of
+	<<0>> -> ok;
+	<<1, Error/binary>> -> {error, binary_to_atom(Error, latin1)}
+    end.
+
 ctl1(Port) ->
     port_control(Port, 1, "hello").
 
@@ -55,17 +145,47 @@ call1(Port, Value) when is_integer(Value) ->
     case Resp of
 	<<0, RefNum:32>> ->
 	    %% io:format("wait for ref = ~p\n", [RefNum]),
-	    receive 
-		{RefNum, Value1} ->
-		    {ok,Value1};
-		Other ->
-		    io:format("Got ~p\n", [Other]),
-		    {error, Other}
-	    end;
+	    call_wait(RefNum, []);
 	<<1, Error/binary>> ->
 	    {error, binary_to_atom(Error, latin1)}
     end.
 
+%% With reply_max set replies arrive as lists [{Ref,Value},...] of any
+%% length that may hold replies to other requests. Only lists that
+%% start with an integer ref are taken from the mailbox, lists without
+%% the reply to RefNum, and the rest of the list that has it, are
+%% sent back to self() once the reply is found. Note that this moves
+%% them behind messages that arrived while waiting.
+call_wait(RefNum, Held) ->
+    receive 
+	{RefNum, Value1} ->
+	    requeue(Held),
+	    {ok,Value1};
+	Replies = [{Ref,_}|_] when is_integer(Ref) ->
+	    case is_reply_list(Replies) andalso
+		lists:keytake(RefNum, 1, Replies) of
+		{value, {RefNum, Value1}, Rest} ->
+		    requeue([Rest|Held]),
+		    {ok,Value1};
+		_ ->
+		    call_wait(RefNum, [Replies|Held])
+	    end;
+	Other ->
+	    io:format("Got ~p\n", [Other]),
+	    requeue(Held),
+	    {error, Other}
+    end.
+
+is_reply_list(List) ->
+    lists:all(fun({Ref,_}) when is_integer(Ref) -> true;
+		 (_) -> false
+	      end, List).
+
+requeue(Held) ->
+    lists:foreach(fun([]) -> ok;
+		     (Replies) -> self() ! Replies
+		  end, lists:reverse(Held)).
+
 seq_call(Port, N) ->
     lists:foreach(
       fun(I) ->